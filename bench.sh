@@ -0,0 +1,53 @@
+#!/bin/sh
+# Run wl9 against fakefs with each synthetic client in benchclient, and
+# print one line of key=value results per mode.
+#
+# BENCHTIME sets the seconds per mode, MOUSEHZ the rate of synthetic
+# pointer motion, and FAKEFSFLAGS and WL9FLAGS are passed to fakefs and
+# wl9 (for example, -l 20 -b 1000 to emulate a slow link).
+
+modes=${*:-noise scroll cursor resize many}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+: "${XDG_RUNTIME_DIR:=$dir}"
+export XDG_RUNTIME_DIR
+
+status=0
+for mode in $modes; do
+	case $mode in
+	resize) opt='-R 20' ;;
+	*) opt= ;;
+	esac
+	./fakefs -m "${MOUSEHZ:-250}" $opt $FAKEFSFLAGS \
+		./wl9 -t 3 $WL9FLAGS ./benchclient -t "${BENCHTIME:-5}" "$mode" >"$dir/out" 2>&1
+	awk -v mode="$mode" '
+	function num(s) {
+		sub(/^[a-z0-9]*=/, "", s)
+		return s + 0
+	}
+	/^frames=/ {
+		frames = num($1)
+		fps = num($3)
+	}
+	/^\tbytes:/ {
+		bytes = num($2) + num($3)
+	}
+	# the window that received the most input
+	/input-to-photon:/ && num($2) >= photon {
+		photon = num($2)
+		p50 = num($3)
+		p99 = num($5)
+	}
+	/^fakefs: child cpu=/ {
+		cpu = num($3)
+	}
+	END {
+		if (!frames) {
+			printf "mode=%s error=noframes\n", mode
+			exit 1
+		}
+		printf "mode=%s frames=%d fps=%.1f bytes_per_frame=%.0f cpu_us_per_frame=%.0f photon_n=%d photon_p50_us=%d photon_p99_us=%d\n",
+			mode, frames, fps, bytes / frames, cpu / frames, photon, p50, p99
+	}' "$dir/out" || { status=1; cat "$dir/out" >&2; }
+done
+exit $status
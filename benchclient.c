@@ -0,0 +1,683 @@
+/* SPDX-License-Identifier: ISC */
+/* benchclient: synthetic wl_shm client driven by bench.sh */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-client.h>
+#include "arg.h"
+#include "record.h"
+#include "util.h"
+#include "xdg-shell-client-protocol.h"
+
+#define LINEHEIGHT 16
+#define CELLWIDTH 8
+#define MAXWINDOWS 256
+
+enum {
+	NOISE,
+	SCROLL,
+	CURSOR,
+	RESIZE,
+	MANY,
+	REPLAY,
+};
+
+struct buffer {
+	struct wl_buffer *wl;
+	uint32_t *data;
+	size_t size;
+	int w, h;
+	int busy;
+};
+
+struct window {
+	struct wl_surface *surface;
+	struct xdg_surface *xdgsurface;
+	struct xdg_toplevel *toplevel;
+	struct wl_callback *frame;
+	struct buffer buf[2];
+	uint32_t *img;  /* current contents */
+	int w, h, confw, confh;
+	int configured, waiting;
+	int n;
+	/* replayed window id and damage */
+	uint32_t id;
+	int damage[4];
+	int dirty;
+};
+
+static struct wl_display *dpy;
+static struct wl_compositor *compositor;
+static struct wl_shm *shm;
+static struct xdg_wm_base *wm;
+static struct wl_seat *seat;
+static struct window *windows;
+static int nwindows;
+static int mode;
+static uint64_t frames, motions;
+static uint32_t seed = 1;
+static struct {
+	FILE *f;
+	double speed;
+	unsigned char hdr[RECHDRSZ];
+	int havehdr, eof;
+	uint64_t first, base;
+	uint64_t commits, bytesin, bytesout;
+} session = {.speed = 1};
+static const char *modes[] = {
+	[NOISE] = "noise",
+	[SCROLL] = "scroll",
+	[CURSOR] = "cursor",
+	[RESIZE] = "resize",
+	[MANY] = "many",
+	[REPLAY] = "replay",
+};
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: benchclient [-t seconds] [-n windows] noise|scroll|cursor|resize|many\n"
+		"       benchclient [-t seconds] [-x speed] replay session\n");
+	exit(1);
+}
+
+static uint32_t
+rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static void
+fill(struct window *w, int x0, int y0, int x1, int y1, uint32_t c)
+{
+	int x, y;
+
+	if (x1 > w->w)
+		x1 = w->w;
+	if (y1 > w->h)
+		y1 = w->h;
+	for (y = y0; y < y1; ++y) {
+		for (x = x0; x < x1; ++x)
+			w->img[y * w->w + x] = c;
+	}
+}
+
+/* a line of terminal-like text: runs of glyph-sized blocks */
+static void
+textline(struct window *w, int y)
+{
+	int x, len;
+
+	fill(w, 0, y, w->w, y + LINEHEIGHT, 0xffffffea);
+	len = rnd() % (w->w / CELLWIDTH);
+	for (x = 0; x < len; ++x) {
+		if (rnd() % 6 == 0)
+			continue;
+		fill(w, x * CELLWIDTH + 1, y + 3, x * CELLWIDTH + CELLWIDTH - 1, y + LINEHEIGHT - 3, 0xff000000);
+	}
+}
+
+/* a mostly static UI: a few panels and some text */
+static void
+staticui(struct window *w)
+{
+	int y;
+
+	fill(w, 0, 0, w->w, w->h, 0xffeaffea);
+	fill(w, 0, 0, w->w, 24, 0xff448844);
+	fill(w, 0, 24, 160, w->h, 0xffccddcc);
+	for (y = 40; y + LINEHEIGHT < w->h; y += 2 * LINEHEIGHT)
+		fill(w, 176, y, 176 + (rnd() % (w->w / 2) + 32), y + LINEHEIGHT - 4, 0xff000000);
+}
+
+/* update the window contents and return the damaged rectangle */
+static void
+update(struct window *w, int r[4])
+{
+	static const int sz = 64;
+	uint32_t *p, *end;
+	int x, y;
+
+	r[0] = 0, r[1] = 0, r[2] = w->w, r[3] = w->h;
+	switch (mode) {
+	case NOISE:
+		for (p = w->img, end = p + w->w * w->h; p < end; ++p)
+			*p = rnd() | 0xff000000;
+		break;
+	case SCROLL:
+		y = w->h / LINEHEIGHT * LINEHEIGHT - LINEHEIGHT;
+		if (y <= 0)
+			break;
+		memmove(w->img, w->img + LINEHEIGHT * w->w, (size_t)y * w->w * 4);
+		textline(w, y);
+		break;
+	case CURSOR:
+		if (w->n == 0) {
+			staticui(w);
+			break;
+		}
+		x = 176, y = 40;
+		fill(w, x, y, x + CELLWIDTH, y + LINEHEIGHT, w->n % 2 ? 0xff000000 : 0xffeaffea);
+		r[0] = x, r[1] = y, r[2] = x + CELLWIDTH, r[3] = y + LINEHEIGHT;
+		break;
+	case RESIZE:
+		staticui(w);
+		break;
+	case MANY:
+		if (w->n == 0) {
+			staticui(w);
+			break;
+		}
+		/* a small animated region, as in a clock or a spinner */
+		x = w->w > sz ? rnd() % (w->w - sz) : 0;
+		y = w->h > sz ? rnd() % (w->h - sz) : 0;
+		fill(w, x, y, x + sz, y + sz, rnd() | 0xff000000);
+		r[0] = x, r[1] = y, r[2] = x + sz, r[3] = y + sz;
+		break;
+	case REPLAY:
+		memcpy(r, w->damage, sizeof w->damage);
+		w->dirty = 0;
+		break;
+	}
+}
+
+static void draw(struct window *);
+
+static void
+buffer_release(void *data, struct wl_buffer *wl)
+{
+	struct buffer *b = data;
+	int i;
+
+	b->busy = 0;
+	for (i = 0; i < nwindows; ++i) {
+		if (windows[i].waiting)
+			draw(&windows[i]);
+	}
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+	.release = buffer_release,
+};
+
+static int
+bufinit(struct buffer *b, int w, int h)
+{
+	struct wl_shm_pool *pool;
+	char name[64];
+	int fd;
+
+	if (b->wl) {
+		wl_buffer_destroy(b->wl);
+		munmap(b->data, b->size);
+		b->wl = NULL;
+	}
+	snprintf(name, sizeof name, "/benchclient-%ld-%u", (long)getpid(), rnd());
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		perror("shm_open");
+		return -1;
+	}
+	shm_unlink(name);
+	b->size = (size_t)w * h * 4;
+	if (ftruncate(fd, b->size) != 0) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+	b->data = mmap(NULL, b->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (b->data == MAP_FAILED) {
+		perror("mmap");
+		close(fd);
+		return -1;
+	}
+	pool = wl_shm_create_pool(shm, fd, b->size);
+	b->wl = wl_shm_pool_create_buffer(pool, 0, w, h, w * 4, WL_SHM_FORMAT_XRGB8888);
+	wl_buffer_add_listener(b->wl, &buffer_listener, b);
+	wl_shm_pool_destroy(pool);
+	close(fd);
+	b->w = w;
+	b->h = h;
+	return 0;
+}
+
+static void
+frame_done(void *data, struct wl_callback *cb, uint32_t time)
+{
+	struct window *w = data;
+
+	wl_callback_destroy(cb);
+	w->frame = NULL;
+	++frames;
+	/* resize mode only redraws when the window changes size */
+	if (mode != RESIZE || w->confw != w->w || w->confh != w->h)
+		draw(w);
+}
+
+static const struct wl_callback_listener frame_listener = {
+	.done = frame_done,
+};
+
+static void
+draw(struct window *w)
+{
+	struct buffer *b;
+	int r[4];
+
+	if (!w->configured || mode == REPLAY && !w->dirty)
+		return;
+	if (w->confw != w->w || w->confh != w->h) {
+		free(w->img);
+		w->w = w->confw;
+		w->h = w->confh;
+		w->img = calloc((size_t)w->w * w->h, 4);
+		if (!w->img) {
+			perror(NULL);
+			exit(1);
+		}
+		w->n = 0;
+	}
+	for (b = w->buf; b < w->buf + 2 && b->busy; ++b)
+		;
+	if (b == w->buf + 2) {
+		/* draw again once a buffer is released */
+		w->waiting = 1;
+		return;
+	}
+	w->waiting = 0;
+	if ((b->w != w->w || b->h != w->h) && bufinit(b, w->w, w->h) != 0)
+		exit(1);
+	update(w, r);
+	memcpy(b->data, w->img, b->size);
+	++w->n;
+	wl_surface_attach(w->surface, b->wl, 0, 0);
+	wl_surface_damage_buffer(w->surface, r[0], r[1], r[2] - r[0], r[3] - r[1]);
+	w->frame = wl_surface_frame(w->surface);
+	wl_callback_add_listener(w->frame, &frame_listener, w);
+	wl_surface_commit(w->surface);
+	b->busy = 1;
+}
+
+static void
+xdgsurface_configure(void *data, struct xdg_surface *s, uint32_t serial)
+{
+	struct window *w = data;
+
+	xdg_surface_ack_configure(s, serial);
+	if (!w->configured) {
+		w->configured = 1;
+		draw(w);
+	} else if (!w->frame && (w->waiting || w->confw != w->w || w->confh != w->h)) {
+		draw(w);
+	}
+}
+
+static const struct xdg_surface_listener xdgsurface_listener = {
+	.configure = xdgsurface_configure,
+};
+
+static void
+toplevel_configure(void *data, struct xdg_toplevel *t, int32_t width, int32_t height, struct wl_array *states)
+{
+	struct window *w = data;
+
+	/* replayed windows keep their recorded size */
+	if (mode == REPLAY)
+		return;
+	w->confw = width > 0 ? width : 640;
+	w->confh = height > 0 ? height : 480;
+}
+
+static void
+toplevel_close(void *data, struct xdg_toplevel *t)
+{
+}
+
+static const struct xdg_toplevel_listener toplevel_listener = {
+	.configure = toplevel_configure,
+	.close = toplevel_close,
+};
+
+static void
+wm_ping(void *data, struct xdg_wm_base *wm, uint32_t serial)
+{
+	xdg_wm_base_pong(wm, serial);
+}
+
+static const struct xdg_wm_base_listener wm_listener = {
+	.ping = wm_ping,
+};
+
+static void
+pointer_enter(void *data, struct wl_pointer *p, uint32_t serial, struct wl_surface *s, wl_fixed_t x, wl_fixed_t y)
+{
+}
+
+static void
+pointer_leave(void *data, struct wl_pointer *p, uint32_t serial, struct wl_surface *s)
+{
+}
+
+static void
+pointer_motion(void *data, struct wl_pointer *p, uint32_t time, wl_fixed_t x, wl_fixed_t y)
+{
+	++motions;
+}
+
+static void
+pointer_button(void *data, struct wl_pointer *p, uint32_t serial, uint32_t time, uint32_t button, uint32_t state)
+{
+}
+
+static void
+pointer_axis(void *data, struct wl_pointer *p, uint32_t time, uint32_t axis, wl_fixed_t val)
+{
+}
+
+static const struct wl_pointer_listener pointer_listener = {
+	.enter = pointer_enter,
+	.leave = pointer_leave,
+	.motion = pointer_motion,
+	.button = pointer_button,
+	.axis = pointer_axis,
+};
+
+static void
+registry_global(void *data, struct wl_registry *reg, uint32_t name, const char *iface, uint32_t ver)
+{
+	if (strcmp(iface, "wl_compositor") == 0)
+		compositor = wl_registry_bind(reg, name, &wl_compositor_interface, 4);
+	else if (strcmp(iface, "wl_shm") == 0)
+		shm = wl_registry_bind(reg, name, &wl_shm_interface, 1);
+	else if (strcmp(iface, "xdg_wm_base") == 0)
+		wm = wl_registry_bind(reg, name, &xdg_wm_base_interface, 1);
+	else if (strcmp(iface, "wl_seat") == 0)
+		seat = wl_registry_bind(reg, name, &wl_seat_interface, 1);
+}
+
+static void
+registry_global_remove(void *data, struct wl_registry *reg, uint32_t name)
+{
+}
+
+static const struct wl_registry_listener registry_listener = {
+	.global = registry_global,
+	.global_remove = registry_global_remove,
+};
+
+static void
+winnew(struct window *w)
+{
+	w->surface = wl_compositor_create_surface(compositor);
+	w->xdgsurface = xdg_wm_base_get_xdg_surface(wm, w->surface);
+	xdg_surface_add_listener(w->xdgsurface, &xdgsurface_listener, w);
+	w->toplevel = xdg_surface_get_toplevel(w->xdgsurface);
+	xdg_toplevel_add_listener(w->toplevel, &toplevel_listener, w);
+	xdg_toplevel_set_title(w->toplevel, modes[mode]);
+	wl_surface_commit(w->surface);
+}
+
+static void
+replayerror(const char *msg)
+{
+	fprintf(stderr, "replay: %s\n", msg);
+	exit(1);
+}
+
+/* apply a recorded commit to the contents of its window */
+static void
+replaycommit(uint32_t len)
+{
+	unsigned char buf[28];
+	struct window *w;
+	uint32_t id;
+	int width, height, x0, y0, x1, y1, y;
+
+	if (len < sizeof buf || fread(buf, 1, sizeof buf, session.f) != sizeof buf)
+		replayerror("short commit record");
+	id = getle32(buf);
+	width = getle32(buf + 4);
+	height = getle32(buf + 8);
+	x0 = getle32(buf + 12);
+	y0 = getle32(buf + 16);
+	x1 = getle32(buf + 20);
+	y1 = getle32(buf + 24);
+	if (width <= 0 || height <= 0 || width > 16384 || height > 16384
+	 || x0 < 0 || y0 < 0 || x1 > width || y1 > height || x0 >= x1 || y0 >= y1
+	 || len != sizeof buf + (size_t)(x1 - x0) * (y1 - y0) * 4)
+		replayerror("invalid commit record");
+	for (w = windows; w < windows + nwindows && w->id != id; ++w)
+		;
+	if (w == windows + nwindows) {
+		if (nwindows == MAXWINDOWS)
+			replayerror("too many windows");
+		++nwindows;
+		w->id = id;
+		winnew(w);
+	}
+	if (width != w->w || height != w->h) {
+		free(w->img);
+		w->img = calloc((size_t)width * height, 4);
+		if (!w->img) {
+			perror(NULL);
+			exit(1);
+		}
+		w->w = w->confw = width;
+		w->h = w->confh = height;
+		w->dirty = 0;
+	}
+	for (y = y0; y < y1; ++y) {
+		if (fread(w->img + y * width + x0, 4, x1 - x0, session.f) != x1 - x0)
+			replayerror("short commit record");
+	}
+	if (!w->dirty) {
+		w->damage[0] = x0, w->damage[1] = y0;
+		w->damage[2] = x1, w->damage[3] = y1;
+		w->dirty = 1;
+	} else {
+		if (x0 < w->damage[0])
+			w->damage[0] = x0;
+		if (y0 < w->damage[1])
+			w->damage[1] = y0;
+		if (x1 > w->damage[2])
+			w->damage[2] = x1;
+		if (y1 > w->damage[3])
+			w->damage[3] = y1;
+	}
+	++session.commits;
+	/* like the recorded client, wait for the previous frame */
+	if (!w->frame)
+		draw(w);
+}
+
+/*
+ * Apply the recorded commits that are due, and return the time in ns
+ * until the next one, or -1 at the end of the session.
+ */
+static int64_t
+replay(uint64_t now)
+{
+	uint64_t t, due;
+	uint32_t len;
+
+	for (;;) {
+		if (!session.havehdr) {
+			if (fread(session.hdr, 1, RECHDRSZ, session.f) != RECHDRSZ) {
+				if (ferror(session.f))
+					replayerror("read failed");
+				session.eof = 1;
+				return -1;
+			}
+			session.havehdr = 1;
+		}
+		t = getle64(session.hdr + 1);
+		len = getle32(session.hdr + 9);
+		if ((session.hdr[0] == RECREAD || session.hdr[0] == RECWRITE) && len < 1)
+			replayerror("invalid data record");
+		switch (session.hdr[0]) {
+		case RECREAD:
+			session.bytesin += len - 1;
+			if (fseek(session.f, len, SEEK_CUR) != 0)
+				replayerror("seek failed");
+			break;
+		case RECWRITE:
+			session.bytesout += len - 1;
+			if (fseek(session.f, len, SEEK_CUR) != 0)
+				replayerror("seek failed");
+			break;
+		case RECCOMMIT:
+			/* time starts at the first commit */
+			if (!session.commits && !session.base) {
+				session.first = t;
+				session.base = now;
+			}
+			due = session.base + (t - session.first) / session.speed;
+			if (due > now)
+				return due - now;
+			replaycommit(len);
+			break;
+		default:
+			replayerror("unknown record type");
+		}
+		session.havehdr = 0;
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct wl_registry *reg;
+	struct wl_pointer *pointer;
+	struct pollfd pfd;
+	uint64_t start, end, now;
+	int64_t next;
+	int timeout;
+	char magic[sizeof RECMAGIC - 1];
+	double secs;
+	long i;
+	char *s;
+
+	secs = 0;
+	ARGBEGIN {
+	case 't':
+		secs = strtod(EARGF(usage()), &s);
+		if (*s || secs <= 0)
+			usage();
+		break;
+	case 'x':
+		session.speed = strtod(EARGF(usage()), &s);
+		if (*s || session.speed <= 0)
+			usage();
+		break;
+	case 'n':
+		nwindows = strtol(EARGF(usage()), &s, 10);
+		if (*s || nwindows < 1 || nwindows > 256)
+			usage();
+		break;
+	default:
+		usage();
+	} ARGEND
+	if (argc < 1)
+		usage();
+	for (i = 0; i < LEN(modes); ++i) {
+		if (strcmp(argv[0], modes[i]) == 0)
+			break;
+	}
+	if (i == LEN(modes) || argc != (i == REPLAY ? 2 : 1))
+		usage();
+	mode = i;
+	if (mode == REPLAY) {
+		session.f = fopen(argv[1], "r");
+		if (!session.f) {
+			perror("open session");
+			return 1;
+		}
+		if (fread(magic, 1, sizeof magic, session.f) != sizeof magic || memcmp(magic, RECMAGIC, sizeof magic) != 0)
+			replayerror("not a wl9 session");
+		/* windows are created as they appear in the session */
+		nwindows = 0;
+	} else if (mode != MANY) {
+		nwindows = 1;
+	} else if (!nwindows) {
+		nwindows = 16;
+	}
+	if (!secs && mode != REPLAY)
+		secs = 5;
+
+	dpy = wl_display_connect(NULL);
+	if (!dpy) {
+		fprintf(stderr, "wl_display_connect failed\n");
+		return 1;
+	}
+	reg = wl_display_get_registry(dpy);
+	wl_registry_add_listener(reg, &registry_listener, NULL);
+	wl_display_roundtrip(dpy);
+	if (!compositor || !shm || !wm) {
+		fprintf(stderr, "missing globals\n");
+		return 1;
+	}
+	xdg_wm_base_add_listener(wm, &wm_listener, NULL);
+	if (seat) {
+		pointer = wl_seat_get_pointer(seat);
+		wl_pointer_add_listener(pointer, &pointer_listener, NULL);
+	}
+	windows = calloc(mode == REPLAY ? MAXWINDOWS : nwindows, sizeof *windows);
+	if (!windows) {
+		perror(NULL);
+		return 1;
+	}
+	for (i = 0; i < nwindows; ++i)
+		winnew(&windows[i]);
+
+	pfd.fd = wl_display_get_fd(dpy);
+	pfd.events = POLLIN;
+	start = now = nsec();
+	end = secs ? start + secs * 1e9 : UINT64_MAX;
+	while (now < end) {
+		timeout = end == UINT64_MAX ? -1 : (end - now + 999999) / 1000000;
+		if (mode == REPLAY && !session.eof) {
+			next = replay(now);
+			if (next >= 0 && (timeout < 0 || (next + 999999) / 1000000 < timeout))
+				timeout = (next + 999999) / 1000000;
+			/* let the last frames finish */
+			if (session.eof && now + 1000000000 < end)
+				end = now + 1000000000, timeout = 1000;
+		}
+		if (wl_display_dispatch_pending(dpy) < 0 || wl_display_flush(dpy) < 0 && errno != EAGAIN)
+			break;
+		if (poll(&pfd, 1, timeout) > 0 && wl_display_dispatch(dpy) < 0)
+			break;
+		now = nsec();
+	}
+	if (now < end) {
+		fprintf(stderr, "connection to compositor failed\n");
+		return 1;
+	}
+
+	printf("frames=%llu seconds=%.3f fps=%.1f motions=%llu\n",
+		(unsigned long long)frames, (now - start) / 1e9,
+		frames / ((now - start) / 1e9), (unsigned long long)motions);
+	if (mode == REPLAY) {
+		printf("commits=%llu recorded_in=%llu recorded_out=%llu\n",
+			(unsigned long long)session.commits,
+			(unsigned long long)session.bytesin, (unsigned long long)session.bytesout);
+	}
+	fflush(stdout);
+	/* ask the compositor for its statistics before we disconnect */
+	kill(getppid(), SIGUSR1);
+	wl_display_roundtrip(dpy);
+	wl_display_disconnect(dpy);
+	return 0;
+}
@@ -603,12 +603,12 @@ R(C9ctx *c, uint32_t size, C9rtype type, C9tag tag, C9error *err)
 }
 
 C9error
-s9version(C9ctx *c)
+s9version(C9ctx *c, C9tag tag)
 {
 	uint8_t *b;
 	C9error err;
 
-	if((b = R(c, 4+2+6, Rversion, 0xffff, &err)) != NULL){
+	if((b = R(c, 4+2+6, Rversion, tag, &err)) != NULL){
 		w32(&b, c->msize);
 		wcs(&b, "9P2000", 6);
 		err = c->end(c);
@@ -850,7 +850,7 @@ C9error
 s9stat(C9ctx *c, C9tag tag, const C9stat *s)
 {
 	uint32_t nlen = safestrlen(s->name), ulen = safestrlen(s->uid);
-	uint32_t glen = safestrlen(s->gid), mulen = safestrlen(s->name);
+	uint32_t glen = safestrlen(s->gid), mulen = safestrlen(s->muid);
 	uint32_t statsz = 2+4+13+4+4+4+8+2+nlen+2+ulen+2+glen+2+mulen;
 	uint8_t *b;
 	C9error err;
@@ -1077,9 +1077,9 @@ s9proc(C9ctx *c)
 			goto error;
 		t.attach.uname = (char*)b;
 		b += cnt;
+		sz -= cnt+2;
 		cnt = r16(&b);
 		b[-2] = 0;
-		sz -= cnt+2;
 		if(cnt > sz)
 			goto error;
 		memmove(b-1, b, cnt);
@@ -343,7 +343,7 @@ extern C9error c9proc(C9ctx *c) __attribute__((nonnull(1)));
 
 #ifndef C9_NO_SERVER
 
-extern C9error s9version(C9ctx *c) __attribute__((nonnull(1)));
+extern C9error s9version(C9ctx *c, C9tag tag) __attribute__((nonnull(1)));
 extern C9error s9auth(C9ctx *c, C9tag tag, const C9qid *aqid) __attribute__((nonnull(1, 3)));
 extern C9error s9error(C9ctx *c, C9tag tag, const char *err) __attribute__((nonnull(1)));
 extern C9error s9attach(C9ctx *c, C9tag tag, const C9qid *qid) __attribute__((nonnull(1, 3)));
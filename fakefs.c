@@ -0,0 +1,1914 @@
+/* SPDX-License-Identifier: ISC */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "arg.h"
+#include "c9.h"
+#include "util.h"
+
+#define MSIZE (1024*1024)  /* largest msize offered */
+#define NQUEUE 64  /* queued input events per window */
+#define MAXCHAN 4  /* 9p connections */
+#define XRGB32 0x68081828
+
+#define QTYPE(p) ((int)((p) & 0xff))
+#define QID(p) ((int)((p) >> 8))
+#define QPATH(t, id) ((uint64_t)(id) << 8 | (t))
+
+/*
+ * The files of the synthetic namespace. The id stored in the qid
+ * path is the window for window files, and the draw connection for
+ * draw files. The root has the id of the initial window, which is
+ * the one serving /dev/wctl, /dev/mouse, etc.
+ */
+enum {
+	Qroot,
+	Qdev,
+	Qenv,
+	Qsrv,
+	Qdraw,
+	Qdrawnew,
+	Qconn,
+	Qdata,
+	Qsnarf,
+	Qkbmap,
+	Qwsysenv,
+	Qwsys,
+	Qwin,
+	Qwctl,
+	Qmouse,
+	Qkbd,
+	Qwinname,
+	Qlabel,
+	Qcursor,
+	NQTYPE,
+};
+
+static const struct {
+	const char *name;
+	int dir;
+	const int *child;
+} files[NQTYPE] = {
+	[Qroot]    = {"/", 1, (const int []){Qdev, Qenv, Qsrv, -1}},
+	[Qdev]     = {"dev", 1, (const int []){Qdraw, Qsnarf, Qkbmap, Qwctl, Qmouse, Qkbd, Qwinname, Qlabel, Qcursor, -1}},
+	[Qenv]     = {"env", 1, (const int []){Qwsysenv, -1}},
+	[Qsrv]     = {"srv", 1, (const int []){Qwsys, -1}},
+	[Qdraw]    = {"draw", 1, (const int []){Qdrawnew, -1}},
+	[Qdrawnew] = {"new"},
+	[Qconn]    = {NULL, 1, (const int []){Qdata, -1}},
+	[Qdata]    = {"data"},
+	[Qsnarf]   = {"snarf"},
+	[Qkbmap]   = {"kbmap"},
+	[Qwsysenv] = {"wsys"},
+	[Qwsys]    = {"rio"},
+	[Qwin]     = {"/", 1, (const int []){Qwctl, Qmouse, Qkbd, Qwinname, Qlabel, Qcursor, -1}},
+	[Qwctl]    = {"wctl"},
+	[Qmouse]   = {"mouse"},
+	[Qkbd]     = {"kbd"},
+	[Qwinname] = {"winname"},
+	[Qlabel]   = {"label"},
+	[Qcursor]  = {"cursor"},
+};
+
+struct fid {
+	int used;
+	uint64_t path;
+	int open;
+	int dirent;
+	int vers;
+};
+
+struct event {
+	unsigned char data[64];
+	uint32_t len;
+};
+
+struct window {
+	int id;
+	int ref;
+	char name[32];
+	char label[128];
+	unsigned char cursor[72];
+	int x0, y0, x1, y1;
+	int current, hidden;
+	int vers;
+	struct {
+		struct event ev[NQUEUE];
+		int head, len;
+	} queue[2];
+	struct window *next;
+};
+
+/* a read of wctl, mouse or kbd that is waiting for an event */
+struct pending {
+	C9aux *chan;
+	C9tag tag;
+	C9fid fid;
+	uint32_t size;
+	struct pending *next;
+};
+
+struct image {
+	int used;
+	int x0, y0, x1, y1;
+	int cx0, cy0, cx1, cy1;
+	int repl;
+	uint32_t chan;
+	uint32_t *data;  /* NULL for window images, which are part of the screen */
+};
+
+struct conn {
+	int id;
+	struct image *img;
+	size_t imglen;
+	struct conn *next;
+};
+
+struct kbmapent {
+	int table, scan, rune;
+};
+
+/* data in transit on the emulated link */
+struct chunk {
+	struct chunk *next;
+	uint64_t due;
+	size_t len, off;
+	uint8_t data[];
+};
+
+struct link {
+	struct chunk *head, **tail;
+	size_t queued;
+	uint64_t idle;  /* time at which the link finishes sending */
+	uint64_t last;  /* arrival time of the last chunk */
+};
+
+/* a 9p connection */
+struct C9aux {
+	C9ctx ctx;
+	int rfd, wfd;
+	uint8_t rbuf[2 * MSIZE], *rpos, *rend;
+	uint8_t wbuf[2 * MSIZE], *wpos;
+	int starved;
+	struct fid *fids;
+	size_t fidslen;
+	struct link in, out;
+};
+
+static C9aux chans[MAXCHAN], *cur;
+static int nchans = 1;
+static pid_t child = -1;
+static uint8_t linkbuf[MSIZE];
+static int hangup;
+
+static struct pending *pending;
+static struct window *windows, *mainwin;
+static int nwindows;
+static struct conn *conns;
+static int nconns;
+
+static uint32_t *fb;
+static int fbw = 1024, fbh = 768;
+
+static struct {
+	char *data;
+	size_t len;
+	uint32_t vers;
+	uint32_t mtime;
+} snarf;
+
+static struct {
+	struct kbmapent *ent;
+	size_t len;
+	char *text;
+	uint32_t vers;
+	uint32_t mtime;
+} kbmap;
+
+static const char wsysenv[] = "/srv/rio";
+
+static struct {
+	uint64_t msgs, flushes, loads, loadbytes, draws, cursors;
+} stats;
+
+static struct {
+	int on;
+	uint64_t latency, jitter;  /* ns */
+	uint64_t bandwidth;        /* bytes per second */
+	size_t maxwrite, bufsize;
+	uint32_t seed;
+} net = {.maxwrite = 64 * 1024, .bufsize = 256 * 1024, .seed = 1};
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: fakefs [-g width,height] [-n conns] [-m mousehz] [-k kbdhz] [-R resizehz] [-o screen.ppm]\n"
+		"              [-l latencyms] [-j jitterms] [-b kbytes/s] [-w maxwrite] [-q bufsize] [cmd [args...]]\n");
+	exit(1);
+}
+
+static void
+ctxerror(C9ctx *c, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+static uint8_t *
+ctxread(C9ctx *c, uint32_t size, int *err)
+{
+	C9aux *a;
+	uint8_t *p;
+
+	a = c->aux;
+	*err = 0;
+	if (a->rend - a->rpos < size) {
+		a->starved = 1;
+		return NULL;
+	}
+	p = a->rpos;
+	a->rpos += size;
+	return p;
+}
+
+static void
+writeall(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t ret;
+
+	for (; len > 0; buf += ret, len -= ret) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+			if (errno == EPIPE) {
+				/* the client is gone; finish up as on EOF */
+				hangup = 1;
+				return;
+			}
+			perror("write");
+			exit(1);
+		}
+	}
+}
+
+/*
+ * Queue data on an emulated link. Each write of at most maxwrite
+ * bytes occupies the link for its transmission time, and arrives
+ * after a further latency plus jitter. Arrivals are kept in order.
+ */
+static void
+linksend(struct link *l, const uint8_t *buf, size_t len)
+{
+	struct chunk *c;
+	uint64_t now;
+	size_t n;
+
+	now = nsec();
+	for (; len > 0; buf += n, len -= n) {
+		n = len < net.maxwrite ? len : net.maxwrite;
+		c = malloc(sizeof *c + n);
+		if (!c) {
+			perror(NULL);
+			exit(1);
+		}
+		memcpy(c->data, buf, n);
+		c->len = n;
+		c->off = 0;
+		c->next = NULL;
+		if (l->idle < now)
+			l->idle = now;
+		if (net.bandwidth)
+			l->idle += n * 1000000000ull / net.bandwidth;
+		c->due = l->idle + net.latency;
+		if (net.jitter) {
+			/* xorshift32, so that runs are reproducible */
+			net.seed ^= net.seed << 13;
+			net.seed ^= net.seed >> 17;
+			net.seed ^= net.seed << 5;
+			c->due += net.seed % net.jitter;
+		}
+		if (c->due < l->last)
+			c->due = l->last;
+		l->last = c->due;
+		if (!l->head)
+			l->tail = &l->head;
+		*l->tail = c;
+		l->tail = &c->next;
+		l->queued += n;
+	}
+}
+
+static void
+flush(C9aux *a)
+{
+	struct chunk *c;
+	uint64_t now;
+
+	if (!net.on) {
+		writeall(a->wfd, a->wbuf, a->wpos - a->wbuf);
+		a->wpos = a->wbuf;
+		return;
+	}
+	linksend(&a->out, a->wbuf, a->wpos - a->wbuf);
+	a->wpos = a->wbuf;
+	now = nsec();
+	while ((c = a->out.head) && c->due <= now) {
+		writeall(a->wfd, c->data, c->len);
+		a->out.head = c->next;
+		a->out.queued -= c->len;
+		free(c);
+	}
+}
+
+static uint8_t *
+ctxbegin(C9ctx *c, uint32_t size)
+{
+	C9aux *a;
+	uint8_t *p;
+
+	a = c->aux;
+	if (size > sizeof a->wbuf - (a->wpos - a->wbuf))
+		flush(a);
+	p = a->wpos;
+	a->wpos += size;
+	return p;
+}
+
+static int
+ctxend(C9ctx *c)
+{
+	return 0;
+}
+
+/* fids belong to the connection being served */
+static struct fid *
+getfid(C9fid num)
+{
+	if (num >= cur->fidslen || !cur->fids[num].used)
+		return NULL;
+	return &cur->fids[num];
+}
+
+static struct window *
+winlookup(int id)
+{
+	struct window *w;
+
+	for (w = windows; w; w = w->next) {
+		if (w->id == id)
+			return w;
+	}
+	return NULL;
+}
+
+static int
+iswin(uint64_t path)
+{
+	return QTYPE(path) >= Qwin || QTYPE(path) == Qroot || QTYPE(path) == Qdev;
+}
+
+static void
+windel(struct window *w)
+{
+	struct window **wp;
+
+	for (wp = &windows; *wp != w; wp = &(*wp)->next)
+		;
+	*wp = w->next;
+	free(w);
+}
+
+/* windows other than the initial one go away with their last fid */
+static void
+winref(uint64_t path, int n)
+{
+	struct window *w;
+
+	if (!iswin(path) || !(w = winlookup(QID(path))))
+		return;
+	w->ref += n;
+	if (w->ref == 0 && w != mainwin)
+		windel(w);
+}
+
+static struct fid *
+newfid(C9fid num, uint64_t path)
+{
+	struct fid *f;
+	size_t len;
+
+	if (num >= cur->fidslen) {
+		len = cur->fidslen ? cur->fidslen : 64;
+		while (len <= num)
+			len *= 2;
+		f = realloc(cur->fids, len * sizeof *f);
+		if (!f)
+			return NULL;
+		memset(f + cur->fidslen, 0, (len - cur->fidslen) * sizeof *f);
+		cur->fids = f;
+		cur->fidslen = len;
+	}
+	f = &cur->fids[num];
+	if (f->used)
+		return NULL;
+	f->used = 1;
+	f->path = path;
+	f->open = 0;
+	f->dirent = 0;
+	f->vers = -1;
+	winref(path, 1);
+	return f;
+}
+
+static void
+freefid(C9fid num)
+{
+	struct fid *f;
+	struct pending *p, **pp;
+
+	f = &cur->fids[num];
+	f->used = 0;
+	for (pp = &pending; (p = *pp);) {
+		if (p->chan == cur && p->fid == num) {
+			*pp = p->next;
+			free(p);
+		} else {
+			pp = &p->next;
+		}
+	}
+	winref(f->path, -1);
+}
+
+static void
+qidset(C9qid *q, uint64_t path)
+{
+	int t;
+
+	t = QTYPE(path);
+	q->path = path;
+	q->type = files[t].dir ? C9qtdir : C9qtfile;
+	q->version = 0;
+	if (t == Qsnarf)
+		q->version = snarf.vers;
+	else if (t == Qkbmap)
+		q->version = kbmap.vers;
+}
+
+static void
+statset(C9stat *st, uint64_t path, char *name)
+{
+	int t;
+
+	t = QTYPE(path);
+	memset(st, 0, sizeof *st);
+	qidset(&st->qid, path);
+	if (files[t].name) {
+		snprintf(name, 12, "%s", files[t].name);
+	} else {
+		snprintf(name, 12, "%d", QID(path));
+	}
+	st->name = name;
+	st->uid = st->gid = st->muid = "fakefs";
+	st->mode = files[t].dir ? C9stdir | 0555 : 0666;
+	switch (t) {
+	case Qsnarf:
+		st->size = snarf.len;
+		st->mtime = snarf.mtime;
+		break;
+	case Qkbmap:
+		st->size = kbmap.len * 36;
+		st->mtime = kbmap.mtime;
+		break;
+	case Qwsysenv:
+		st->size = sizeof wsysenv - 1;
+		break;
+	}
+}
+
+static void
+kbmapupdate(void)
+{
+	char *text, *pos;
+	size_t i;
+
+	text = realloc(kbmap.text, kbmap.len * 36 + 1);
+	if (!text) {
+		perror(NULL);
+		exit(1);
+	}
+	kbmap.text = text;
+	pos = text;
+	for (i = 0; i < kbmap.len; ++i)
+		pos += sprintf(pos, "%11d %11d %11d\n", kbmap.ent[i].table, kbmap.ent[i].scan, kbmap.ent[i].rune);
+	++kbmap.vers;
+	kbmap.mtime = time(NULL);
+}
+
+static int
+kbmapset(int table, int scan, int rune)
+{
+	struct kbmapent *e;
+
+	for (e = kbmap.ent; e < kbmap.ent + kbmap.len; ++e) {
+		if (e->table == table && e->scan == scan) {
+			e->rune = rune;
+			return 0;
+		}
+	}
+	if ((kbmap.len & kbmap.len - 1) == 0) {
+		e = realloc(kbmap.ent, (kbmap.len ? kbmap.len * 2 : 64) * sizeof *e);
+		if (!e)
+			return -1;
+		kbmap.ent = e;
+	}
+	e = &kbmap.ent[kbmap.len++];
+	e->table = table;
+	e->scan = scan;
+	e->rune = rune;
+	return 0;
+}
+
+/* a small US layout; enough for the keys generated by -k */
+static void
+kbmapinit(void)
+{
+	static const struct {
+		int scan;
+		const char *plain, *shift;
+	} rows[] = {
+		{0x02, "1234567890-=", "!@#$%^&*()_+"},
+		{0x10, "qwertyuiop[]", "QWERTYUIOP{}"},
+		{0x1e, "asdfghjkl;'`", "ASDFGHJKL:\"~"},
+		{0x2b, "\\zxcvbnm,./", "|ZXCVBNM<>?"},
+	};
+	size_t i, j;
+
+	for (i = 0; i < LEN(rows); ++i) {
+		for (j = 0; rows[i].plain[j]; ++j) {
+			kbmapset(0, rows[i].scan + j, rows[i].plain[j]);
+			kbmapset(1, rows[i].scan + j, rows[i].shift[j]);
+		}
+	}
+	kbmapset(0, 0x01, 0x1b);
+	kbmapset(0, 0x0e, '\b');
+	kbmapset(0, 0x0f, '\t');
+	kbmapset(0, 0x1c, '\n');
+	kbmapset(0, 0x39, ' ');
+	kbmapset(0, 0x2a, 0xf016);  /* Kshift */
+	kbmapset(0, 0x1d, 0xf017);  /* Kctl */
+	kbmapset(0, 0x38, 0xf015);  /* Kalt */
+	kbmapupdate();
+}
+
+static int
+wctlstr(struct window *w, char *buf)
+{
+	return sprintf(buf, "%11d %11d %11d %11d %11s %11s ", w->x0, w->y0, w->x1, w->y1,
+		w->current ? "current" : "notcurrent", w->hidden ? "hidden" : "visible");
+}
+
+static void
+pendingadd(C9tag tag, C9fid fid, uint32_t size)
+{
+	struct pending *p, **pp;
+
+	p = malloc(sizeof *p);
+	if (!p) {
+		s9error(&cur->ctx, tag, "out of memory");
+		return;
+	}
+	p->chan = cur;
+	p->tag = tag;
+	p->fid = fid;
+	p->size = size;
+	p->next = NULL;
+	for (pp = &pending; *pp; pp = &(*pp)->next)
+		;
+	*pp = p;
+}
+
+/* answer any waiting reads of window w that can now complete */
+static void
+wake(struct window *w)
+{
+	struct pending *p, **pp;
+	struct fid *f;
+	struct event *e;
+	char buf[73];
+	int t, n;
+
+	for (pp = &pending; (p = *pp);) {
+		f = &p->chan->fids[p->fid];
+		t = QTYPE(f->path);
+		if (QID(f->path) != w->id)
+			goto next;
+		if (t == Qwctl) {
+			if (f->vers == w->vers)
+				goto next;
+			f->vers = w->vers;
+			n = wctlstr(w, buf);
+			s9read(&p->chan->ctx, p->tag, buf, n < p->size ? n : p->size);
+		} else {
+			if (w->queue[t - Qmouse].len == 0)
+				goto next;
+			e = &w->queue[t - Qmouse].ev[w->queue[t - Qmouse].head];
+			w->queue[t - Qmouse].head = (w->queue[t - Qmouse].head + 1) % NQUEUE;
+			--w->queue[t - Qmouse].len;
+			s9read(&p->chan->ctx, p->tag, e->data, e->len < p->size ? e->len : p->size);
+		}
+		*pp = p->next;
+		free(p);
+		continue;
+	next:
+		pp = &p->next;
+	}
+}
+
+static void
+winevent(struct window *w, int t, const void *data, uint32_t len)
+{
+	struct event *e;
+	int i;
+
+	i = t - Qmouse;
+	if (w->queue[i].len == NQUEUE) {
+		w->queue[i].head = (w->queue[i].head + 1) % NQUEUE;
+		--w->queue[i].len;
+	}
+	e = &w->queue[i].ev[(w->queue[i].head + w->queue[i].len++) % NQUEUE];
+	memcpy(e->data, data, len);
+	e->len = len;
+	wake(w);
+}
+
+static void
+wincurrent(struct window *cur)
+{
+	struct window *w;
+
+	for (w = windows; w; w = w->next) {
+		if (w->current != (w == cur)) {
+			w->current = w == cur;
+			++w->vers;
+			wake(w);
+		}
+	}
+}
+
+static struct window *
+winnew(void)
+{
+	struct window *w;
+
+	w = calloc(1, sizeof *w);
+	if (!w)
+		return NULL;
+	w->id = ++nwindows;
+	snprintf(w->name, sizeof w->name, "window.%d.%d", w->id, w->id);
+	if (w->id == 1) {
+		w->x0 = 0;
+		w->y0 = 0;
+		w->x1 = fbw;
+		w->y1 = fbh;
+	} else {
+		/* later windows cascade at half the screen size */
+		w->x0 = (w->id - 2) % 16 * fbw / 32;
+		w->y0 = (w->id - 2) % 16 * fbh / 32;
+		w->x1 = w->x0 + fbw / 2;
+		w->y1 = w->y0 + fbh / 2;
+	}
+	w->next = windows;
+	windows = w;
+	wincurrent(w);
+	return w;
+}
+
+static struct window *
+wincur(void)
+{
+	struct window *w;
+
+	for (w = windows; w; w = w->next) {
+		if (w->current)
+			return w;
+	}
+	return NULL;
+}
+
+static const char *
+wctlwrite(struct window *w, char *buf)
+{
+	char *cmd, *arg, *pos;
+	int r[4], i;
+
+	cmd = strtok_r(buf, " \n", &pos);
+	if (!cmd)
+		return "bad wctl message";
+	if (strcmp(cmd, "current") == 0 || strcmp(cmd, "top") == 0) {
+		wincurrent(w);
+		return NULL;
+	}
+	if (strcmp(cmd, "hide") == 0 || strcmp(cmd, "unhide") == 0) {
+		w->hidden = cmd[0] == 'h';
+	} else if (strcmp(cmd, "resize") == 0 || strcmp(cmd, "move") == 0) {
+		arg = strtok_r(NULL, " \n", &pos);
+		if (!arg || strcmp(arg, "-r") != 0)
+			return "bad wctl message";
+		for (i = 0; i < 4; ++i) {
+			arg = strtok_r(NULL, " \n", &pos);
+			if (!arg)
+				return "bad wctl message";
+			r[i] = atoi(arg);
+		}
+		if (r[2] - r[0] < 16 || r[3] - r[1] < 16)
+			return "window too small";
+		w->x0 = r[0], w->y0 = r[1];
+		w->x1 = r[2], w->y1 = r[3];
+	} else if (strcmp(cmd, "bottom") != 0) {
+		return "bad wctl message";
+	}
+	++w->vers;
+	wake(w);
+	return NULL;
+}
+
+static int
+chandepth(uint32_t chan)
+{
+	int d;
+
+	for (d = 0; chan; chan >>= 8)
+		d += chan & 15;
+	return d;
+}
+
+static int
+chanalpha(uint32_t chan)
+{
+	for (; chan; chan >>= 8) {
+		if ((chan >> 4 & 15) == 4)
+			return 1;
+	}
+	return 0;
+}
+
+static struct image *
+imglookup(struct conn *c, uint32_t id)
+{
+	if (id >= c->imglen || !c->img[id].used)
+		return NULL;
+	return &c->img[id];
+}
+
+static struct image *
+imgnew(struct conn *c, uint32_t id)
+{
+	struct image *img;
+	size_t len;
+
+	if (id > 1 << 20)
+		return NULL;
+	if (id >= c->imglen) {
+		len = c->imglen ? c->imglen : 16;
+		while (len <= id)
+			len *= 2;
+		img = realloc(c->img, len * sizeof *img);
+		if (!img)
+			return NULL;
+		memset(img + c->imglen, 0, (len - c->imglen) * sizeof *img);
+		c->img = img;
+		c->imglen = len;
+	}
+	img = &c->img[id];
+	if (img->used)
+		return NULL;
+	memset(img, 0, sizeof *img);
+	img->used = 1;
+	return img;
+}
+
+static void
+imgscreen(struct image *img, int x0, int y0, int x1, int y1)
+{
+	img->x0 = x0, img->y0 = y0;
+	img->x1 = x1, img->y1 = y1;
+	img->cx0 = x0 > 0 ? x0 : 0;
+	img->cy0 = y0 > 0 ? y0 : 0;
+	img->cx1 = x1 < fbw ? x1 : fbw;
+	img->cy1 = y1 < fbh ? y1 : fbh;
+	img->chan = XRGB32;
+	img->data = NULL;
+}
+
+static struct conn *
+connnew(void)
+{
+	struct conn *c;
+
+	c = calloc(1, sizeof *c);
+	if (!c)
+		return NULL;
+	c->id = ++nconns;
+	if (!imgnew(c, 0)) {
+		free(c);
+		return NULL;
+	}
+	imgscreen(&c->img[0], 0, 0, fbw, fbh);
+	c->next = conns;
+	conns = c;
+	return c;
+}
+
+static struct conn *
+connlookup(int id)
+{
+	struct conn *c;
+
+	for (c = conns; c; c = c->next) {
+		if (c->id == id)
+			return c;
+	}
+	return NULL;
+}
+
+static uint32_t *
+pixel(struct image *img, int x, int y)
+{
+	if (!img->data)
+		return &fb[y * fbw + x];
+	return &img->data[(y - img->y0) * (img->x1 - img->x0) + x - img->x0];
+}
+
+/* fetch a pixel, taking replication into account */
+static int
+getpixel(struct image *img, int x, int y, uint32_t *v)
+{
+	int w, h;
+
+	if (img->repl) {
+		w = img->x1 - img->x0;
+		h = img->y1 - img->y0;
+		x = img->x0 + ((x - img->x0) % w + w) % w;
+		y = img->y0 + ((y - img->y0) % h + h) % h;
+	}
+	if (x < img->cx0 || x >= img->cx1 || y < img->cy0 || y >= img->cy1)
+		return 0;
+	*v = *pixel(img, x, y);
+	if (!chanalpha(img->chan))
+		*v |= 0xff000000;
+	return 1;
+}
+
+static void
+drawop(struct image *dst, struct image *src, struct image *mask, int r[4], int sp[2], int mp[2])
+{
+	int x, y, x0, y0, x1, y1, i;
+	uint32_t s, m, d, *p;
+	unsigned sa, ma, out;
+
+	x0 = r[0] > dst->cx0 ? r[0] : dst->cx0;
+	y0 = r[1] > dst->cy0 ? r[1] : dst->cy0;
+	x1 = r[2] < dst->cx1 ? r[2] : dst->cx1;
+	y1 = r[3] < dst->cy1 ? r[3] : dst->cy1;
+	if (x0 < dst->x0)
+		x0 = dst->x0;
+	if (y0 < dst->y0)
+		y0 = dst->y0;
+	if (x1 > dst->x1)
+		x1 = dst->x1;
+	if (y1 > dst->y1)
+		y1 = dst->y1;
+	for (y = y0; y < y1; ++y) {
+		for (x = x0; x < x1; ++x) {
+			if (!getpixel(src, sp[0] + x - r[0], sp[1] + y - r[1], &s))
+				continue;
+			if (!getpixel(mask, mp[0] + x - r[0], mp[1] + y - r[1], &m))
+				continue;
+			ma = m >> 24;
+			sa = (s >> 24) * ma / 255;
+			p = pixel(dst, x, y);
+			d = *p;
+			out = 0;
+			/* source is premultiplied */
+			for (i = 0; i < 32; i += 8)
+				out |= ((s >> i & 0xff) * ma / 255 + (d >> i & 0xff) * (255 - sa) / 255) << i;
+			*p = out;
+		}
+	}
+	++stats.draws;
+}
+
+static const char *
+drawload(struct image *img, int r[4], const unsigned char *data)
+{
+	int x, y, w;
+
+	if (chandepth(img->chan) != 32)
+		return "unsupported image depth";
+	if (img->data && (r[0] < img->x0 || r[1] < img->y0 || r[2] > img->x1 || r[3] > img->y1))
+		return "bad rectangle";
+	w = r[2] - r[0];
+	for (y = r[1]; y < r[3]; ++y) {
+		if (y < img->cy0 || y >= img->cy1)
+			continue;
+		for (x = r[0]; x < r[2]; ++x) {
+			if (x >= img->cx0 && x < img->cx1)
+				*pixel(img, x, y) = getle32((void *)(data + ((y - r[1]) * w + x - r[0]) * 4));
+		}
+	}
+	++stats.loads;
+	stats.loadbytes += (size_t)w * (r[3] - r[1]) * 4;
+	return NULL;
+}
+
+/* decompress image data in the format described in image(6) */
+static long
+cload(unsigned char *out, size_t outlen, const unsigned char *data, size_t len)
+{
+	const unsigned char *pos, *end;
+	size_t o, n, off;
+
+	pos = data;
+	end = data + len;
+	for (o = 0; o < outlen;) {
+		if (pos == end)
+			return -1;
+		if (*pos & 0x80) {
+			n = (*pos++ & 0x7f) + 1;
+			if (n > end - pos || n > outlen - o)
+				return -1;
+			memcpy(out + o, pos, n);
+			pos += n;
+			o += n;
+		} else {
+			if (end - pos < 2)
+				return -1;
+			n = (*pos >> 2) + 3;
+			off = ((*pos & 3) << 8 | pos[1]) + 1;
+			pos += 2;
+			if (off > o || n > outlen - o)
+				return -1;
+			for (; n > 0; --n, ++o)
+				out[o] = out[o - off];
+		}
+	}
+	return pos - data;
+}
+
+static void
+getrect(int r[4], unsigned char *p)
+{
+	int i;
+
+	for (i = 0; i < 4; ++i)
+		r[i] = (int32_t)getle32(p + 4 * i);
+}
+
+static const char *
+drawwrite(struct conn *c, unsigned char *pos, uint32_t len)
+{
+	unsigned char *end, *buf;
+	struct image *img, *src, *mask;
+	struct window *w;
+	int r[4], cr[4], sp[2], mp[2];
+	uint32_t color;
+	size_t n, x, y;
+	long ret;
+	const char *err;
+
+	end = pos + len;
+	while (pos < end) {
+		n = end - pos;
+		switch (*pos) {
+		case 'b':
+			if (n < 51)
+				return "short draw message";
+			img = imgnew(c, getle32(pos + 1));
+			if (!img)
+				return "image id in use";
+			getrect(r, pos + 15);
+			getrect(cr, pos + 31);
+			img->chan = getle32(pos + 10);
+			img->repl = pos[14];
+			color = getle32(pos + 47);
+			if (r[2] <= r[0] || r[3] <= r[1] || r[2] - r[0] > 16384 || r[3] - r[1] > 16384
+			 || chandepth(img->chan) != 32) {
+				img->used = 0;
+				return "bad image parameters";
+			}
+			img->x0 = r[0], img->y0 = r[1];
+			img->x1 = r[2], img->y1 = r[3];
+			img->cx0 = cr[0] > r[0] || img->repl ? cr[0] : r[0];
+			img->cy0 = cr[1] > r[1] || img->repl ? cr[1] : r[1];
+			img->cx1 = cr[2] < r[2] || img->repl ? cr[2] : r[2];
+			img->cy1 = cr[3] < r[3] || img->repl ? cr[3] : r[3];
+			n = (size_t)(r[2] - r[0]) * (r[3] - r[1]);
+			img->data = malloc(n * sizeof *img->data);
+			if (!img->data) {
+				img->used = 0;
+				return "out of memory";
+			}
+			/* color is RGBA; pixels are stored as ARGB */
+			color = color >> 8 | color << 24;
+			for (x = 0; x < n; ++x)
+				img->data[x] = color;
+			pos += 51;
+			break;
+		case 'd':
+			if (n < 45)
+				return "short draw message";
+			img = imglookup(c, getle32(pos + 1));
+			src = imglookup(c, getle32(pos + 5));
+			mask = imglookup(c, getle32(pos + 9));
+			if (!img || !src || !mask)
+				return "unknown id for draw image";
+			getrect(r, pos + 13);
+			sp[0] = (int32_t)getle32(pos + 29);
+			sp[1] = (int32_t)getle32(pos + 33);
+			mp[0] = (int32_t)getle32(pos + 37);
+			mp[1] = (int32_t)getle32(pos + 41);
+			drawop(img, src, mask, r, sp, mp);
+			pos += 45;
+			break;
+		case 'f':
+			if (n < 5)
+				return "short draw message";
+			img = imglookup(c, getle32(pos + 1));
+			if (!img || img == c->img)
+				return "unknown id for draw image";
+			free(img->data);
+			img->used = 0;
+			pos += 5;
+			break;
+		case 'n':
+			if (n < 6 || n < 6 + pos[5])
+				return "short draw message";
+			for (w = windows; w; w = w->next) {
+				if (strlen(w->name) == pos[5] && memcmp(w->name, pos + 6, pos[5]) == 0)
+					break;
+			}
+			if (!w)
+				return "unknown image name";
+			img = imgnew(c, getle32(pos + 1));
+			if (!img)
+				return "image id in use";
+			imgscreen(img, w->x0, w->y0, w->x1, w->y1);
+			pos += 6 + pos[5];
+			break;
+		case 'v':
+			++stats.flushes;
+			++pos;
+			break;
+		case 'y':
+		case 'Y':
+			if (n < 21)
+				return "short draw message";
+			img = imglookup(c, getle32(pos + 1));
+			if (!img)
+				return "unknown id for draw image";
+			getrect(r, pos + 5);
+			if (r[2] < r[0] || r[3] < r[1])
+				return "bad rectangle";
+			x = (size_t)(r[2] - r[0]) * 4;
+			y = r[3] - r[1];
+			if (*pos == 'y') {
+				if (n - 21 < x * y)
+					return "short draw message";
+				err = drawload(img, r, pos + 21);
+				pos += 21 + x * y;
+			} else {
+				buf = malloc(x * y);
+				if (!buf)
+					return "out of memory";
+				ret = cload(buf, x * y, pos + 21, n - 21);
+				err = ret < 0 ? "bad compressed data" : drawload(img, r, buf);
+				free(buf);
+				pos += 21 + ret;
+			}
+			if (err)
+				return err;
+			break;
+		default:
+			return "bad draw command";
+		}
+	}
+	return NULL;
+}
+
+static void
+tattach(C9t *t)
+{
+	struct fid *f, *wsys;
+	struct window *w;
+	C9qid qid;
+	char *end;
+	long fid;
+
+	if (getfid(t->fid)) {
+		s9error(&cur->ctx, t->tag, "fid in use");
+		return;
+	}
+	if (!t->attach.aname || !*t->attach.aname) {
+		f = newfid(t->fid, QPATH(Qroot, mainwin->id));
+	} else {
+		/* see exportfs.patch */
+		fid = strtol(t->attach.aname, &end, 10);
+		wsys = fid >= 0 && fid <= UINT32_MAX ? getfid(fid) : NULL;
+		if (end - t->attach.aname != 11 || *end != ' ' || !wsys || QTYPE(wsys->path) != Qwsys) {
+			s9error(&cur->ctx, t->tag, "unknown aname");
+			return;
+		}
+		if (strncmp(end + 1, "new", 3) != 0) {
+			s9error(&cur->ctx, t->tag, "bad attach specifier");
+			return;
+		}
+		w = winnew();
+		if (!w) {
+			s9error(&cur->ctx, t->tag, "out of memory");
+			return;
+		}
+		f = newfid(t->fid, QPATH(Qwin, w->id));
+	}
+	if (!f) {
+		s9error(&cur->ctx, t->tag, "out of memory");
+		return;
+	}
+	qidset(&qid, f->path);
+	s9attach(&cur->ctx, t->tag, &qid);
+}
+
+static int
+walk1(uint64_t *path, const char *name)
+{
+	const int *c;
+	int t, id;
+	char *end;
+
+	t = QTYPE(*path);
+	id = QID(*path);
+	if (!files[t].dir)
+		return -1;
+	if (strcmp(name, "..") == 0) {
+		switch (t) {
+		case Qdev: case Qenv: case Qsrv: t = Qroot; break;
+		case Qdraw: t = Qdev, id = mainwin->id; break;
+		case Qconn: t = Qdraw, id = mainwin->id; break;
+		}
+		*path = QPATH(t, id);
+		return 0;
+	}
+	if (t == Qdraw) {
+		id = strtol(name, &end, 10);
+		if (*end == '\0' && connlookup(id)) {
+			*path = QPATH(Qconn, id);
+			return 0;
+		}
+	}
+	for (c = files[t].child; *c >= 0; ++c) {
+		if (strcmp(name, files[*c].name) == 0) {
+			*path = QPATH(*c, id);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static void
+twalk(C9t *t)
+{
+	C9qid qid[C9maxpathel], *qids[C9maxpathel + 1];
+	struct fid *f;
+	uint64_t path;
+	int i;
+
+	f = getfid(t->fid);
+	if (!f) {
+		s9error(&cur->ctx, t->tag, "unknown fid");
+		return;
+	}
+	if (f->open) {
+		s9error(&cur->ctx, t->tag, "fid is open");
+		return;
+	}
+	if (t->walk.newfid != t->fid && getfid(t->walk.newfid)) {
+		s9error(&cur->ctx, t->tag, "fid in use");
+		return;
+	}
+	path = f->path;
+	for (i = 0; t->walk.wname[i]; ++i) {
+		if (walk1(&path, t->walk.wname[i]) != 0)
+			break;
+		qidset(&qid[i], path);
+		qids[i] = &qid[i];
+	}
+	qids[i] = NULL;
+	if (i == 0 && t->walk.wname[0]) {
+		s9error(&cur->ctx, t->tag, "file does not exist");
+		return;
+	}
+	if (!t->walk.wname[i]) {
+		if (t->walk.newfid == t->fid) {
+			winref(path, 1);
+			winref(f->path, -1);
+			f->path = path;
+		} else if (!newfid(t->walk.newfid, path)) {
+			s9error(&cur->ctx, t->tag, "out of memory");
+			return;
+		}
+	}
+	s9walk(&cur->ctx, t->tag, qids);
+}
+
+static void
+topen(C9t *t)
+{
+	struct fid *f;
+	struct conn *c;
+	C9qid qid;
+
+	f = getfid(t->fid);
+	if (!f) {
+		s9error(&cur->ctx, t->tag, "unknown fid");
+		return;
+	}
+	if (files[QTYPE(f->path)].dir && (t->open.mode & 3) != C9read) {
+		s9error(&cur->ctx, t->tag, "is a directory");
+		return;
+	}
+	switch (QTYPE(f->path)) {
+	case Qdrawnew:
+		c = connnew();
+		if (!c) {
+			s9error(&cur->ctx, t->tag, "out of memory");
+			return;
+		}
+		f->path = QPATH(Qdrawnew, c->id);
+		break;
+	case Qsnarf:
+		if ((t->open.mode & 3) != C9read) {
+			snarf.len = 0;
+			++snarf.vers;
+			snarf.mtime = time(NULL);
+		}
+		break;
+	}
+	f->open = 1;
+	qidset(&qid, f->path);
+	s9open(&cur->ctx, t->tag, &qid, cur->ctx.msize - 24);
+}
+
+static void
+readstr(C9t *t, const char *s, size_t len)
+{
+	if (t->read.offset >= len)
+		len = 0;
+	else
+		len -= t->read.offset;
+	if (len > t->read.size)
+		len = t->read.size;
+	s9read(&cur->ctx, t->tag, len ? s + t->read.offset : "", len);
+}
+
+static void
+readdir(C9t *t, struct fid *f)
+{
+	C9stat st[16], *stp[16];
+	char names[16][12];
+	struct conn *c;
+	const int *child;
+	uint64_t off;
+	int n, num;
+
+	if (t->read.offset == 0)
+		f->dirent = 0;
+	n = 0;
+	for (child = files[QTYPE(f->path)].child; *child >= 0; ++child)
+		statset(&st[n], QPATH(*child, QID(f->path)), names[n]), ++n;
+	if (QTYPE(f->path) == Qdraw) {
+		for (c = conns; c && n < LEN(st); c = c->next)
+			statset(&st[n], QPATH(Qconn, c->id), names[n]), ++n;
+	}
+	for (num = 0; num < n; ++num)
+		stp[num] = &st[num];
+	num = f->dirent < n ? n - f->dirent : 0;
+	off = t->read.offset;
+	s9readdir(&cur->ctx, t->tag, stp + f->dirent, &num, &off, t->read.size);
+	f->dirent += num;
+}
+
+static void
+tread(C9t *t)
+{
+	struct fid *f;
+	struct window *w;
+	char buf[145];
+	uint64_t n;
+
+	f = getfid(t->fid);
+	if (!f || !f->open) {
+		s9error(&cur->ctx, t->tag, "fid not open");
+		return;
+	}
+	if (files[QTYPE(f->path)].dir) {
+		readdir(t, f);
+		return;
+	}
+	w = winlookup(QID(f->path));
+	switch (QTYPE(f->path)) {
+	case Qdrawnew:
+		snprintf(buf, sizeof buf, "%11d %11d %11s %11d %11d %11d %11d %11d %11d %11d %11d %11d ",
+			QID(f->path), 0, "x8r8g8b8", 0, 0, 0, fbw, fbh, 0, 0, fbw, fbh);
+		readstr(t, buf, 144);
+		break;
+	case Qsnarf:
+		readstr(t, snarf.data, snarf.len);
+		break;
+	case Qkbmap:
+		/* like kbdfs, at most one line per read */
+		n = t->read.offset / 36 * 36 + 36;
+		readstr(t, kbmap.text, n < kbmap.len * 36 ? n : kbmap.len * 36);
+		break;
+	case Qwsysenv:
+		readstr(t, wsysenv, sizeof wsysenv - 1);
+		break;
+	case Qwinname:
+		readstr(t, w->name, strlen(w->name));
+		break;
+	case Qlabel:
+		readstr(t, w->label, strlen(w->label));
+		break;
+	case Qwctl:
+	case Qmouse:
+	case Qkbd:
+		pendingadd(t->tag, t->fid, t->read.size);
+		wake(w);
+		break;
+	default:
+		s9read(&cur->ctx, t->tag, "", 0);
+	}
+}
+
+static void
+twrite(C9t *t)
+{
+	struct fid *f;
+	struct window *w;
+	const char *err;
+	char *buf, *pos, *line;
+	size_t len;
+	int table, scan, rune;
+
+	f = getfid(t->fid);
+	if (!f || !f->open) {
+		s9error(&cur->ctx, t->tag, "fid not open");
+		return;
+	}
+	w = winlookup(QID(f->path));
+	err = NULL;
+	switch (QTYPE(f->path)) {
+	case Qdata:
+		err = drawwrite(connlookup(QID(f->path)), t->write.data, t->write.size);
+		break;
+	case Qsnarf:
+		len = t->write.offset + t->write.size;
+		if (len > 1 << 24) {
+			err = "snarf buffer too long";
+			break;
+		}
+		if (len > snarf.len) {
+			buf = realloc(snarf.data, len);
+			if (!buf) {
+				err = "out of memory";
+				break;
+			}
+			snarf.data = buf;
+			snarf.len = len;
+		}
+		memcpy(snarf.data + t->write.offset, t->write.data, t->write.size);
+		++snarf.vers;
+		snarf.mtime = time(NULL);
+		break;
+	case Qkbmap:
+		buf = malloc(t->write.size + 1);
+		if (!buf) {
+			err = "out of memory";
+			break;
+		}
+		memcpy(buf, t->write.data, t->write.size);
+		buf[t->write.size] = '\0';
+		for (line = strtok_r(buf, "\n", &pos); line; line = strtok_r(NULL, "\n", &pos)) {
+			if (sscanf(line, "%d %d %d", &table, &scan, &rune) != 3) {
+				err = "bad kbmap line";
+				break;
+			}
+			kbmapset(table, scan, rune);
+		}
+		free(buf);
+		kbmapupdate();
+		break;
+	case Qlabel:
+		len = t->write.size < sizeof w->label - 1 ? t->write.size : sizeof w->label - 1;
+		memcpy(w->label, t->write.data, len);
+		w->label[len] = '\0';
+		break;
+	case Qcursor:
+		/* like rio, a short write restores the default cursor */
+		if (t->write.size >= sizeof w->cursor)
+			memcpy(w->cursor, t->write.data, sizeof w->cursor);
+		else
+			memset(w->cursor, 0, sizeof w->cursor);
+		++stats.cursors;
+		break;
+	case Qwctl:
+		buf = malloc(t->write.size + 1);
+		if (!buf) {
+			err = "out of memory";
+			break;
+		}
+		memcpy(buf, t->write.data, t->write.size);
+		buf[t->write.size] = '\0';
+		err = wctlwrite(w, buf);
+		free(buf);
+		break;
+	default:
+		err = "permission denied";
+	}
+	if (err)
+		s9error(&cur->ctx, t->tag, err);
+	else
+		s9write(&cur->ctx, t->tag, t->write.size);
+}
+
+static void
+tflush(C9t *t)
+{
+	struct pending *p, **pp;
+
+	for (pp = &pending; (p = *pp); pp = &p->next) {
+		if (p->chan == cur && p->tag == t->flush.oldtag) {
+			*pp = p->next;
+			free(p);
+			break;
+		}
+	}
+	s9flush(&cur->ctx, t->tag);
+}
+
+static void
+ctxt(C9ctx *c, C9t *t)
+{
+	struct fid *f;
+	C9stat st;
+	char name[12];
+
+	++stats.msgs;
+	cur = c->aux;
+	switch (t->type) {
+	case Tversion:
+		s9version(c, t->tag);
+		break;
+	case Tauth:
+		s9error(c, t->tag, "authentication not required");
+		break;
+	case Tattach:
+		tattach(t);
+		break;
+	case Tflush:
+		tflush(t);
+		break;
+	case Twalk:
+		twalk(t);
+		break;
+	case Topen:
+		topen(t);
+		break;
+	case Tread:
+		tread(t);
+		break;
+	case Twrite:
+		twrite(t);
+		break;
+	case Tclunk:
+		if (!getfid(t->fid)) {
+			s9error(c, t->tag, "unknown fid");
+			break;
+		}
+		freefid(t->fid);
+		s9clunk(c, t->tag);
+		break;
+	case Tstat:
+		f = getfid(t->fid);
+		if (!f) {
+			s9error(c, t->tag, "unknown fid");
+			break;
+		}
+		statset(&st, f->path, name);
+		s9stat(c, t->tag, &st);
+		break;
+	default:
+		s9error(c, t->tag, "permission denied");
+	}
+}
+
+static int
+writeppm(const char *path)
+{
+	FILE *f;
+	uint32_t *p;
+	unsigned char rgb[3];
+
+	f = fopen(path, "w");
+	if (!f) {
+		perror("open");
+		return -1;
+	}
+	fprintf(f, "P6\n%d %d\n255\n", fbw, fbh);
+	for (p = fb; p < fb + fbw * fbh; ++p) {
+		rgb[0] = *p >> 16, rgb[1] = *p >> 8, rgb[2] = *p;
+		fwrite(rgb, 1, 3, f);
+	}
+	if (fclose(f) != 0) {
+		perror("write");
+		return -1;
+	}
+	return 0;
+}
+
+/* synthetic input: the pointer bounces around the current window */
+static void
+mousetick(void)
+{
+	static int x, y, dx = 7, dy = 5;
+	struct window *w;
+	char buf[64];
+
+	w = wincur();
+	if (!w)
+		return;
+	x += dx, y += dy;
+	if (x < w->x0 || x >= w->x1)
+		dx = -dx, x = x < w->x0 ? w->x0 : w->x1 - 1;
+	if (y < w->y0 || y >= w->y1)
+		dy = -dy, y = y < w->y0 ? w->y0 : w->y1 - 1;
+	snprintf(buf, sizeof buf, "m%11d %11d %11d %11lu ", x, y, 0, (unsigned long)(nsec() / 1000000));
+	winevent(w, Qmouse, buf, 49);
+}
+
+/* synthetic input: type the alphabet, one press or release per tick */
+static void
+kbdtick(void)
+{
+	static int n;
+	struct window *w;
+	char buf[3];
+
+	w = wincur();
+	if (!w)
+		return;
+	if (n % 2 == 0) {
+		buf[0] = 'k';
+		buf[1] = 'a' + n / 2 % 26;
+		buf[2] = '\0';
+		winevent(w, Qkbd, buf, 3);
+	} else {
+		winevent(w, Qkbd, "K", 2);
+	}
+	++n;
+}
+
+/* synthetic resizes: the current window alternates between two sizes */
+static void
+resizetick(void)
+{
+	static int n, dx, dy;
+	struct window *w;
+
+	w = wincur();
+	if (!w)
+		return;
+	if (n++ % 2 == 0) {
+		dx = (w->x1 - w->x0) / 4;
+		dy = (w->y1 - w->y0) / 4;
+		w->x1 -= dx;
+		w->y1 -= dy;
+	} else {
+		w->x1 += dx;
+		w->y1 += dy;
+	}
+	++w->vers;
+	wake(w);
+}
+
+static long
+numarg(char *s, long max)
+{
+	long n;
+
+	errno = 0;
+	n = strtol(s, &s, 10);
+	if (errno != 0 || n < 0 || n > max || *s != '\0')
+		usage();
+	return n;
+}
+
+/* process the 9p messages in rbuf */
+static void
+process(C9aux *a)
+{
+	for (a->starved = 0; !a->starved;) {
+		if (s9proc(&a->ctx) != 0)
+			exit(1);
+	}
+	memmove(a->rbuf, a->rpos, a->rend - a->rpos);
+	a->rend -= a->rpos - a->rbuf;
+	a->rpos = a->rbuf;
+}
+
+/* move data that has crossed the emulated link into rbuf */
+static void
+linkrecv(C9aux *a)
+{
+	struct chunk *c;
+	uint64_t now;
+	size_t n;
+
+	now = nsec();
+	while ((c = a->in.head) && c->due <= now) {
+		n = c->len - c->off;
+		if (n > a->rbuf + sizeof a->rbuf - a->rend)
+			n = a->rbuf + sizeof a->rbuf - a->rend;
+		memcpy(a->rend, c->data + c->off, n);
+		a->rend += n;
+		c->off += n;
+		process(a);
+		if (c->off < c->len)
+			continue;
+		a->in.head = c->next;
+		a->in.queued -= c->len;
+		free(c);
+	}
+}
+
+static void
+linktimeout(struct link *l, uint64_t now, int64_t *timeout)
+{
+	int64_t t;
+
+	if (!l->head)
+		return;
+	t = l->head->due > now ? (l->head->due - now + 999999) / 1000000 : 0;
+	if (*timeout < 0 || t < *timeout)
+		*timeout = t;
+}
+
+/* run argv with a connection on each of file descriptors 3, 4, ... */
+static void
+spawn(char *argv[])
+{
+	extern char **environ;
+	posix_spawn_file_actions_t fa;
+	int fd[2], cfd[MAXCHAN], i, err;
+
+	posix_spawn_file_actions_init(&fa);
+	for (i = 0; i < nchans; ++i) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) != 0) {
+			perror("socketpair");
+			exit(1);
+		}
+		fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+		chans[i].rfd = chans[i].wfd = fd[0];
+		/* move the child's end out of the way of the dup2s below */
+		cfd[i] = fcntl(fd[1], F_DUPFD, 3 + nchans);
+		if (cfd[i] < 0) {
+			perror("fcntl F_DUPFD");
+			exit(1);
+		}
+		close(fd[1]);
+		posix_spawn_file_actions_adddup2(&fa, cfd[i], 3 + i);
+	}
+	for (i = 0; i < nchans; ++i)
+		posix_spawn_file_actions_addclose(&fa, cfd[i]);
+	err = posix_spawnp(&child, argv[0], &fa, NULL, argv, environ);
+	if (err) {
+		fprintf(stderr, "spawn %s: %s\n", argv[0], strerror(err));
+		exit(1);
+	}
+	posix_spawn_file_actions_destroy(&fa);
+	for (i = 0; i < nchans; ++i)
+		close(cfd[i]);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct pollfd pfd[MAXCHAN];
+	struct rusage ru;
+	C9aux *a;
+	char *out, *end;
+	uint64_t now, next[3], period[3];
+	int64_t timeout;
+	uint8_t *buf;
+	size_t len;
+	ssize_t ret;
+	long i;
+
+	out = NULL;
+	period[0] = period[1] = period[2] = 0;
+	ARGBEGIN {
+	case 'g':
+		fbw = strtol(EARGF(usage()), &end, 10);
+		if (*end != ',')
+			usage();
+		fbh = strtol(end + 1, &end, 10);
+		if (*end || fbw < 64 || fbh < 64 || fbw > 8192 || fbh > 8192)
+			usage();
+		break;
+	case 'm':
+		i = numarg(EARGF(usage()), 100000);
+		period[0] = i ? 1000000000 / i : 0;
+		break;
+	case 'k':
+		i = numarg(EARGF(usage()), 100000);
+		period[1] = i ? 1000000000 / i : 0;
+		break;
+	case 'R':
+		i = numarg(EARGF(usage()), 1000);
+		period[2] = i ? 1000000000 / i : 0;
+		break;
+	case 'n':
+		nchans = numarg(EARGF(usage()), MAXCHAN);
+		if (nchans == 0)
+			usage();
+		break;
+	case 'o':
+		out = EARGF(usage());
+		break;
+	case 'l':
+		net.latency = numarg(EARGF(usage()), 100000) * 1000000;
+		net.on = 1;
+		break;
+	case 'j':
+		net.jitter = numarg(EARGF(usage()), 100000) * 1000000;
+		net.on = 1;
+		break;
+	case 'b':
+		net.bandwidth = numarg(EARGF(usage()), 10000000) * 1024ull;
+		net.on = 1;
+		break;
+	case 'w':
+		net.maxwrite = numarg(EARGF(usage()), MSIZE);
+		if (net.maxwrite == 0)
+			usage();
+		net.on = 1;
+		break;
+	case 'q':
+		net.bufsize = numarg(EARGF(usage()), 1 << 30);
+		if (net.bufsize == 0)
+			usage();
+		net.on = 1;
+		break;
+	default:
+		usage();
+	} ARGEND
+
+	signal(SIGPIPE, SIG_IGN);
+	fb = calloc((size_t)fbw * fbh, sizeof *fb);
+	if (!fb) {
+		perror(NULL);
+		return 1;
+	}
+	kbmapinit();
+	mainwin = winnew();
+	if (!mainwin) {
+		perror(NULL);
+		return 1;
+	}
+	if (argc > 0) {
+		spawn(argv);
+	} else if (nchans == 1) {
+		chans[0].rfd = 0;
+		chans[0].wfd = 1;
+	} else {
+		usage();
+	}
+
+	for (i = 0; i < nchans; ++i) {
+		a = &chans[i];
+		a->rpos = a->rend = a->rbuf;
+		a->wpos = a->wbuf;
+		a->ctx.read = ctxread;
+		a->ctx.begin = ctxbegin;
+		a->ctx.end = ctxend;
+		a->ctx.t = ctxt;
+		a->ctx.error = ctxerror;
+		a->ctx.msize = MSIZE;
+		a->ctx.aux = a;
+		pfd[i].fd = a->rfd;
+		pfd[i].events = POLLIN;
+	}
+	now = nsec();
+	next[0] = next[1] = next[2] = now;
+	for (;;) {
+		now = nsec();
+		timeout = -1;
+		for (i = 0; i < 3; ++i) {
+			if (!period[i])
+				continue;
+			if (now >= next[i]) {
+				if (i == 0)
+					mousetick();
+				else if (i == 1)
+					kbdtick();
+				else
+					resizetick();
+				next[i] += period[i];
+				if (next[i] < now)
+					next[i] = now + period[i];
+			}
+			if (timeout < 0 || (int64_t)(next[i] - now) / 1000000 < timeout)
+				timeout = (next[i] - now) / 1000000;
+		}
+		for (i = 0; i < nchans; ++i) {
+			a = &chans[i];
+			if (net.on) {
+				linkrecv(a);
+				linktimeout(&a->in, now, &timeout);
+				linktimeout(&a->out, now, &timeout);
+				/* stop reading when the link buffer is full */
+				pfd[i].events = a->in.queued < net.bufsize ? POLLIN : 0;
+			}
+		}
+		/* replies to one connection may be caused by another */
+		for (i = 0; i < nchans; ++i) {
+			flush(&chans[i]);
+			if (net.on)
+				linktimeout(&chans[i].out, now, &timeout);
+		}
+		if (hangup)
+			break;
+		if (poll(pfd, nchans, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return 1;
+		}
+		for (i = 0; i < nchans; ++i) {
+			if (!pfd[i].revents)
+				continue;
+			a = &chans[i];
+			if (net.on) {
+				buf = linkbuf;
+				len = net.bufsize - a->in.queued;
+				if (len > sizeof linkbuf)
+					len = sizeof linkbuf;
+			} else {
+				buf = a->rend;
+				len = a->rbuf + sizeof a->rbuf - a->rend;
+			}
+			ret = read(a->rfd, buf, len);
+			if (ret <= 0) {
+				if (ret < 0)
+					perror("read");
+				goto done;
+			}
+			if (net.on) {
+				linksend(&a->in, buf, ret);
+			} else {
+				a->rend += ret;
+				process(a);
+			}
+		}
+	}
+done:
+	fprintf(stderr, "fakefs: msgs=%"PRIu64" loads=%"PRIu64" loadbytes=%"PRIu64" draws=%"PRIu64" flushes=%"PRIu64" cursors=%"PRIu64"\n",
+		stats.msgs, stats.loads, stats.loadbytes, stats.draws, stats.flushes, stats.cursors);
+	if (child > 0 && waitpid(child, NULL, 0) == child && getrusage(RUSAGE_CHILDREN, &ru) == 0) {
+		fprintf(stderr, "fakefs: child cpu=%ldus\n",
+			(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000L + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+	}
+	if (out && writeppm(out) != 0)
+		return 1;
+	return 0;
+}
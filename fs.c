@@ -1,7 +1,8 @@
 /* SPDX-License-Identifier: ISC */
-#define _POSIX_C_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -9,16 +10,20 @@
 #include <string.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include "c9.h"
 #include "util.h"
 #include "fs.h"
+#include "record.h"
+#include "trace.h"
 
 #define NOTAG 0xffff
 
 struct reply {
 	C9r r;
 	struct reply *next;
+	uint64_t time;
 	uint32_t size;
 	uint8_t data[];
 };
@@ -26,6 +31,14 @@ struct reply {
 struct callback {
 	void (*fn)(C9r *, void *);
 	void *aux;
+	C9ttype type;
+	uint64_t time;
+	int fid;  /* released when an asynchronous Tclunk is answered */
+};
+
+static const char *msgname[NMSGTYPE / 2] = {
+	"version", "auth", "attach", "error", "flush", "walk", "open",
+	"create", "read", "write", "clunk", "remove", "stat", "wstat",
 };
 
 static C9error
@@ -47,6 +60,27 @@ newtag(C9ctx *ctx, C9ttype type, C9tag *tagp)
 		aux->cb = cb;
 		aux->cblen = tag + 1;
 	}
+	switch (type) {
+	case Tread:
+		aux->txq = QINPUT;
+		break;
+	case Twrite:
+		aux->txq = aux->bulk ? QBULK : QCTL;
+		break;
+	case Tflush:
+	case Tclunk:
+	case Tremove:
+		/* these must not overtake requests they refer to */
+		aux->txq = QBULK;
+		break;
+	default:
+		aux->txq = QCTL;
+	}
+	aux->cb[tag].type = type;
+	aux->cb[tag].time = nsec();
+	++aux->stats.msgs[type - Tversion];
+	if (++aux->stats.tags > aux->stats.maxtags)
+		aux->stats.maxtags = aux->stats.tags;
 	*tagp = tag;
 	return 0;
 }
@@ -54,34 +88,94 @@ newtag(C9ctx *ctx, C9ttype type, C9tag *tagp)
 static void
 freetag(C9ctx *ctx, C9tag tag)
 {
-	numput(&ctx->aux->tag, tag);
+	if (numput(&ctx->aux->tag, tag) == 0)
+		--ctx->aux->stats.tags;
 }
 
+/*
+ * Queues are written in order of priority, so control and input
+ * messages go out ahead of bulk data that is still waiting for the
+ * connection to become writable. A partially written message is
+ * always finished first. Everything queued is gathered into a single
+ * writev, so messages queued during one pass of the event loop cost
+ * one syscall.
+ */
 static void
 write9p(C9ctx *ctx, int block)
 {
 	C9aux *aux;
+	struct wqueue *q, *iovq[NQUEUE + 1];
+	struct iovec iov[NQUEUE + 1];
+	uint8_t *pos;
+	size_t len, n;
 	ssize_t ret;
 	struct pollfd pfd;
+	uint64_t t;
+	int i, niov;
 
 	aux = ctx->aux;
-	while (aux->wpos < aux->wend) {
-		ret = write(aux->wfd, aux->wpos, aux->wend - aux->wpos);
+	for (;;) {
+		niov = 0;
+		if ((q = aux->partial)) {
+			iov[niov].iov_base = q->pos;
+			iov[niov].iov_len = q->msgend - q->pos;
+			iovq[niov++] = q;
+		}
+		len = 0;
+		for (q = aux->wq; q < aux->wq + NQUEUE; ++q) {
+			pos = q == aux->partial ? q->msgend : q->pos;
+			if (pos == q->end)
+				continue;
+			iov[niov].iov_base = pos;
+			iov[niov].iov_len = q->end - pos;
+			iovq[niov++] = q;
+		}
+		if (niov == 0)
+			break;
+		if (aux->maxwrite) {
+			for (i = 0; i < niov && len < aux->maxwrite; ++i) {
+				if (iov[i].iov_len > aux->maxwrite - len)
+					iov[i].iov_len = aux->maxwrite - len;
+				len += iov[i].iov_len;
+			}
+			niov = i;
+		}
+		ret = writev(aux->wfd, iov, niov);
 		if (ret < 0) {
 			if (errno == EAGAIN) {
 				if (!block)
 					return;
 				pfd.fd = aux->wfd;
 				pfd.events = POLLOUT;
+				t = nsec();
 				poll(&pfd, 1, -1);
+				aux->stats.writeblock += nsec() - t;
 				continue;
 			}
 			snprintf(aux->err, sizeof aux->err, "write: %s", strerror(errno));
 			exit(1);
 		}
-		aux->wpos += ret;
+		++aux->stats.writes;
+		aux->stats.bytesout += ret;
+		for (i = 0; i < niov && ret > 0; ++i) {
+			q = iovq[i];
+			n = (size_t)ret < iov[i].iov_len ? (size_t)ret : iov[i].iov_len;
+			if (q != &aux->wq[QBULK] && aux->wq[QBULK].pos < aux->wq[QBULK].end)
+				aux->stats.bypass += n;
+			recdata(RECWRITE, aux->conn, q->pos, n);
+			q->pos += n;
+			ret -= n;
+		}
+		aux->partial = NULL;
+		for (q = aux->wq; q < aux->wq + NQUEUE; ++q) {
+			while (q->msgend < q->pos)
+				q->msgend += getle32(q->msgend);
+			if (q->pos < q->msgend)
+				aux->partial = q;
+			else if (q->pos == q->end)
+				q->pos = q->end = q->msgend = q->buf;
+		}
 	}
-	aux->wpos = aux->wend = aux->wbuf;
 }
 
 static uint8_t *
@@ -92,19 +186,22 @@ read9p(C9ctx *ctx, uint32_t size, int *err)
 	ssize_t ret;
 
 	aux = ctx->aux;
-	assert(size <= sizeof aux->rbuf);
-	if (aux->rend == aux->rpos || aux->rbuf + sizeof aux->rbuf - aux->rpos < size) {
+	assert(size <= aux->bufsize);
+	if (aux->rend == aux->rpos || aux->rbuf + aux->bufsize - aux->rpos < size) {
 		memmove(aux->rbuf, aux->rpos, aux->rend - aux->rpos);
 		aux->rend = aux->rbuf + (aux->rend - aux->rpos);
 		aux->rpos = aux->rbuf;
 	}
 	while (aux->rend - aux->rpos < size) {
-		ret = read(aux->rfd, aux->rend, sizeof aux->rbuf - (aux->rend - aux->rbuf));
+		ret = read(aux->rfd, aux->rend, aux->bufsize - (aux->rend - aux->rbuf));
 		if (ret <= 0) {
 			*err = ret == 0 || errno != EAGAIN;
 			aux->ready = 0;
 			return NULL;
 		}
+		++aux->stats.reads;
+		aux->stats.bytesin += ret;
+		recdata(RECREAD, aux->conn, aux->rend, ret);
 		aux->rend += ret;
 	}
 	buf = aux->rpos;
@@ -116,14 +213,16 @@ static uint8_t *
 begin(C9ctx *ctx, uint32_t size)
 {
 	C9aux *aux;
+	struct wqueue *q;
 	uint8_t *buf;
 
 	aux = ctx->aux;
-	assert(size <= sizeof aux->wbuf);
-	if (size > aux->wbuf + sizeof aux->wbuf - aux->wend)
+	q = &aux->wq[aux->txq];
+	assert(size <= aux->bufsize);
+	if (size > q->buf + aux->bufsize - q->end)
 		write9p(ctx, 1);
-	buf = aux->wend;
-	aux->wend += size;
+	buf = q->end;
+	q->end += size;
 	return buf;
 }
 
@@ -138,6 +237,7 @@ r(C9ctx *ctx, C9r *r)
 {
 	C9aux *aux;
 	struct reply *reply;
+	struct callback *cb;
 	size_t size;
 
 	aux = ctx->aux;
@@ -161,14 +261,34 @@ r(C9ctx *ctx, C9r *r)
 		reply->r.read.data = reply->data;
 		memcpy(reply->data, r->read.data, size);
 		break;
+	case Rstat:
+		size = strlen(r->stat.name) + strlen(r->stat.uid) + strlen(r->stat.gid) + strlen(r->stat.muid) + 4;
+		reply = malloc(sizeof *reply + size);
+		if (!reply)
+			goto error;
+		reply->r = *r;
+		reply->r.stat.name = strcpy((char *)reply->data, r->stat.name);
+		reply->r.stat.uid = strcpy(reply->r.stat.name + strlen(r->stat.name) + 1, r->stat.uid);
+		reply->r.stat.gid = strcpy(reply->r.stat.uid + strlen(r->stat.uid) + 1, r->stat.gid);
+		reply->r.stat.muid = strcpy(reply->r.stat.gid + strlen(r->stat.gid) + 1, r->stat.muid);
+		break;
 	default:
 		reply = malloc(sizeof *reply);
 		if (!reply)
 			goto error;
 		reply->r = *r;
 	}
+	reply->time = nsec();
 	reply->next = aux->queue;
 	aux->queue = reply;
+	++aux->stats.msgs[r->type - Tversion];
+	if (r->tag < aux->cblen && aux->cb[r->tag].time) {
+		cb = &aux->cb[r->tag];
+		histadd(&aux->stats.rtt[(cb->type - Tversion) / 2], (reply->time - cb->time) / 1000);
+		cb->time = 0;
+	}
+	if (++aux->stats.queue > aux->stats.maxqueue)
+		aux->stats.maxqueue = aux->stats.queue;
 	return;
 
 error:
@@ -218,6 +338,8 @@ error:
 int
 fsinit(C9ctx *ctx, C9aux *aux)
 {
+	int i;
+
 	ctx->newtag = newtag;
 	ctx->freetag = freetag;
 	ctx->read = read9p;
@@ -226,13 +348,37 @@ fsinit(C9ctx *ctx, C9aux *aux)
 	ctx->r = r;
 	ctx->error = error;
 	ctx->aux = aux;
+	if (aux->msize == 0)
+		aux->msize = BUFSIZE;
+	/* every queue may hold a message of the full msize */
+	aux->bufsize = aux->msize;
+	aux->rbuf = malloc(aux->bufsize);
+	if (!aux->rbuf)
+		goto error;
 	aux->rpos = aux->rend = aux->rbuf;
-	aux->wpos = aux->wend = aux->wbuf;
+	for (i = 0; i < NQUEUE; ++i) {
+		aux->wq[i].buf = malloc(aux->bufsize);
+		if (!aux->wq[i].buf)
+			goto error;
+		aux->wq[i].pos = aux->wq[i].end = aux->wq[i].msgend = aux->wq[i].buf;
+	}
+	aux->partial = NULL;
 	aux->queue = NULL;
 	aux->cb = NULL;
 	aux->cblen = 0;
 	fcntl(aux->rfd, F_SETFL, O_NONBLOCK);
-	return fsversion(ctx, sizeof aux->rbuf);
+	return fsversion(ctx, aux->msize);
+
+error:
+	perror("fsinit");
+	return -1;
+}
+
+/* time at which a queued reply was received */
+uint64_t
+fstime(C9r *r)
+{
+	return ((struct reply *)r)->time;
 }
 
 void
@@ -252,7 +398,10 @@ fswait(C9ctx *ctx, C9tag tag, C9rtype type)
 	C9aux *aux;
 	struct reply *r, **rp;
 	struct pollfd pfd;
+	uint64_t t;
 
+	TRACEBEGIN(span);
+	t = nsec();
 	write9p(ctx, 1);
 	aux = ctx->aux;
 	for (rp = &aux->queue; (r = *rp); rp = &r->next) {
@@ -284,6 +433,8 @@ fswait(C9ctx *ctx, C9tag tag, C9rtype type)
 		}
 	}
 found:
+	--aux->stats.queue;
+	aux->stats.waitblock += nsec() - t;
 	freetag(ctx, r->r.tag);
 	if (r->r.type == Rerror) {
 		snprintf(aux->err, sizeof aux->err, "%s", r->r.error);
@@ -293,6 +444,7 @@ found:
 		fprintf(stderr, "fswait: unexpected reply type: %d != %d\n", r->r.type, type);
 		exit(1);
 	}
+	TRACEEND(span, "fswait");
 	return &r->r;
 }
 
@@ -302,6 +454,42 @@ fswriteT(C9ctx *ctx)
 	write9p(ctx, 0);
 }
 
+/* whether any messages are waiting to be written */
+int
+fspending(C9ctx *ctx)
+{
+	C9aux *aux;
+	int i;
+
+	aux = ctx->aux;
+	for (i = 0; i < NQUEUE; ++i) {
+		if (aux->wq[i].pos < aux->wq[i].end)
+			return 1;
+	}
+	return 0;
+}
+
+/* queue writes to fid behind control and input messages */
+void
+fsbulk(C9ctx *ctx, int fid, int on)
+{
+	C9aux *aux;
+	uint8_t *p;
+
+	aux = ctx->aux;
+	if (fid >= aux->bulkfidlen) {
+		if (!on)
+			return;
+		p = realloc(aux->bulkfid, fid + 1);
+		if (!p)
+			return;  /* writes stay in the control queue */
+		memset(p + aux->bulkfidlen, 0, fid + 1 - aux->bulkfidlen);
+		aux->bulkfid = p;
+		aux->bulkfidlen = fid + 1;
+	}
+	aux->bulkfid[fid] = on;
+}
+
 void
 fsreadR(C9ctx *ctx)
 {
@@ -324,15 +512,20 @@ fsdispatch(C9ctx *ctx)
 	struct reply *r;
 	struct callback cb;
 
+	TRACEBEGIN(span);
 	aux = ctx->aux;
 	while (aux->queue) {
 		r = aux->queue;
 		aux->queue = r->next;
+		--aux->stats.queue;
 		cb.fn = NULL;
+		cb.type = 0;
 		if (r->r.tag < aux->cblen) {
 			cb = aux->cb[r->r.tag];
 			aux->cb[r->r.tag].fn = NULL;
 		}
+		if (cb.type == Tclunk)
+			numput(&aux->fid, cb.fid);
 		if (cb.fn)
 			cb.fn(&r->r, cb.aux);
 		else if (r->r.type == Rerror)
@@ -342,7 +535,32 @@ fsdispatch(C9ctx *ctx)
 		freetag(ctx, r->r.tag);
 		free(r);
 	}
-	write9p(ctx, 0);
+	TRACEEND(span, "fsdispatch");
+}
+
+void
+fsstats(C9ctx *ctx, FILE *f)
+{
+	struct fsstats *s;
+	struct hist *h;
+	int i;
+
+	s = &ctx->aux->stats;
+	fprintf(f, "\tbytes: in=%"PRIu64" out=%"PRIu64" reads=%"PRIu64" writes=%"PRIu64"\n",
+		s->bytesin, s->bytesout, s->reads, s->writes);
+	fprintf(f, "\tbypass: %"PRIu64" bytes ahead of bulk\n", s->bypass);
+	fprintf(f, "\ttags: %d (max %d) queue: %d (max %d)\n",
+		s->tags, s->maxtags, s->queue, s->maxqueue);
+	fprintf(f, "\tblocked: write9p=%"PRIu64"us fswait=%"PRIu64"us\n",
+		s->writeblock / 1000, s->waitblock / 1000);
+	for (i = 0; i < NMSGTYPE / 2; ++i) {
+		if (s->msgs[2 * i] == 0 && s->msgs[2 * i + 1] == 0)
+			continue;
+		h = &s->rtt[i];
+		fprintf(f, "\t%s: T=%"PRIu64" R=%"PRIu64" rtt p50=%"PRIu64"us p95=%"PRIu64"us p99=%"PRIu64"us\n",
+			msgname[i], s->msgs[2 * i], s->msgs[2 * i + 1],
+			histpct(h, 50), histpct(h, 95), histpct(h, 99));
+	}
 }
 
 int
@@ -367,6 +585,7 @@ fsflush(C9ctx *ctx, C9tag oldtag)
 	for(rp = &aux->queue; (r = *rp); rp = &r->next) {
 		if (r->r.tag == oldtag) {
 			*rp = r->next;
+			--aux->stats.queue;
 			free(r);
 			break;
 		}
@@ -480,12 +699,18 @@ fsread(C9ctx *ctx, C9tag *tagp, C9r **rp, int fid, uint64_t off, uint32_t len)
 int
 fswrite(C9ctx *ctx, C9tag *tagp, int fid, uint64_t off, const void *buf, uint32_t len)
 {
+	C9aux *aux;
 	C9tag tag;
 	C9r *r;
+	int ret;
 
+	aux = ctx->aux;
 	if (tagp)
 		*tagp = NOTAG;
-	if (c9write(ctx, &tag, fid, off, buf, len) != 0)
+	aux->bulk = fid < aux->bulkfidlen && aux->bulkfid[fid];
+	ret = c9write(ctx, &tag, fid, off, buf, len);
+	aux->bulk = 0;
+	if (ret != 0)
 		return -1;
 	if (tagp) {
 		*tagp = tag;
@@ -499,16 +724,137 @@ fswrite(C9ctx *ctx, C9tag *tagp, int fid, uint64_t off, const void *buf, uint32_
 }
 
 int
-fsclunk(C9ctx *ctx, int fid)
+fsstat(C9ctx *ctx, C9tag *tagp, C9r **rp, int fid)
 {
 	C9tag tag;
 	C9r *r;
 
+	assert(tagp || rp);
+	if (tagp)
+		*tagp = NOTAG;
+	if (c9stat(ctx, &tag, fid) != 0)
+		return -1;
+	if (tagp) {
+		*tagp = tag;
+		return 0;
+	}
+	r = fswait(ctx, tag, Rstat);
+	if (!r)
+		return -1;
+	*rp = r;
+	return 0;
+}
+
+int
+fsclunk(C9ctx *ctx, C9tag *tagp, int fid)
+{
+	C9aux *aux;
+	C9tag tag;
+	C9r *r;
+
+	aux = ctx->aux;
+	if (tagp)
+		*tagp = NOTAG;
 	if (c9clunk(ctx, &tag, fid) != 0)
 		return -1;
+	if (fid < aux->bulkfidlen)
+		aux->bulkfid[fid] = 0;
+	if (tagp) {
+		/* the fid is released by fsdispatch */
+		aux->cb[tag].fid = fid;
+		*tagp = tag;
+		return 0;
+	}
 	r = fswait(ctx, tag, Rclunk);
+	/* the fid is gone even if the clunk failed */
+	numput(&aux->fid, fid);
 	if (!r)
 		return -1;
 	free(r);
 	return 0;
 }
+
+/* fid walked to path from root, walking it on first use */
+static int
+walked(C9ctx *ctx, int root, const char *path[])
+{
+	C9aux *aux;
+	struct walked *w;
+	char key[256], *pos;
+	int fid, i, n;
+
+	aux = ctx->aux;
+	pos = key;
+	*pos = '\0';
+	for (i = 0; path[i]; ++i) {
+		n = snprintf(pos, key + sizeof key - pos, "/%s", path[i]);
+		if (n < 0 || n >= key + sizeof key - pos) {
+			snprintf(aux->err, sizeof aux->err, "path too long");
+			return -1;
+		}
+		pos += n;
+	}
+	for (w = aux->walked; w < aux->walked + LEN(aux->walked); ++w) {
+		if (w->path && w->root == root && strcmp(w->path, key) == 0)
+			return w->fid;
+	}
+	fid = fswalk(ctx, NULL, root, path);
+	if (fid < 0)
+		return -1;
+	w = &aux->walked[aux->walkednext];
+	aux->walkednext = (aux->walkednext + 1) % LEN(aux->walked);
+	if (w->path) {
+		fsclunk(ctx, NULL, w->fid);
+		free(w->path);
+	}
+	w->path = strdup(key);
+	if (!w->path) {
+		snprintf(aux->err, sizeof aux->err, "%s", strerror(errno));
+		fsclunk(ctx, NULL, fid);
+		return -1;
+	}
+	w->root = root;
+	w->fid = fid;
+	return fid;
+}
+
+/*
+ * Open path from root on a clone of a cached walked fid. The clone
+ * and open are pipelined, so opening a path again takes one round
+ * trip rather than two.
+ */
+int
+fsopenpath(C9ctx *ctx, int root, const char *path[], C9mode mode)
+{
+	C9aux *aux;
+	C9tag walktag, opentag;
+	C9r *rwalk, *ropen;
+	int fid, newfid;
+
+	aux = ctx->aux;
+	fid = walked(ctx, root, path);
+	if (fid < 0)
+		return -1;
+	newfid = fswalk(ctx, &walktag, fid, (const char *[]){0});
+	if (newfid < 0)
+		return -1;
+	if (fsopen(ctx, &opentag, newfid, mode) != 0) {
+		free(fswait(ctx, walktag, Rwalk));
+		fsclunk(ctx, NULL, newfid);
+		return -1;
+	}
+	ropen = fswait(ctx, opentag, Ropen);
+	rwalk = fswait(ctx, walktag, Rwalk);
+	if (!rwalk) {
+		free(ropen);
+		numput(&aux->fid, newfid);
+		return -1;
+	}
+	free(rwalk);
+	if (!ropen) {
+		fsclunk(ctx, NULL, newfid);
+		return -1;
+	}
+	free(ropen);
+	return newfid;
+}
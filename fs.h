@@ -1,27 +1,81 @@
 /* SPDX-License-Identifier: ISC */
-#define BUFSIZE (32*1024ul)  /* maximum I/O size of virtio-serial */
+#define BUFSIZE (32*1024ul)  /* default msize, the maximum I/O size of virtio-serial */
+#define MAXMSIZE (16*1024*1024ul)
 #define IOHDRSZ 24
 
+/* transmit queues, in order of priority */
+enum {
+	QCTL,    /* walks, opens, stats and small writes */
+	QINPUT,  /* reads, re-armed after every input event */
+	QBULK,   /* writes to the bulk fid, and flushes and clunks */
+	NQUEUE,
+};
+
+/* 9p message types are in [Tversion, Rwstat] */
+#define NMSGTYPE (Rwstat - Tversion + 1)
+
+struct fsstats {
+	uint64_t msgs[NMSGTYPE];
+	uint64_t bytesin, bytesout;
+	uint64_t reads, writes;
+	/* bytes sent ahead of queued bulk messages */
+	uint64_t bypass;
+	int tags, maxtags;
+	int queue, maxqueue;
+	/* time blocked in write9p and fswait (ns) */
+	uint64_t writeblock, waitblock;
+	/* round-trip time by T-message type (us) */
+	struct hist rtt[NMSGTYPE / 2];
+};
+
+struct wqueue {
+	uint8_t *buf, *pos, *end;
+	/* end of the message at pos */
+	uint8_t *msgend;
+};
+
+/* a fid walked to path from root, kept for cloning */
+struct walked {
+	int root, fid;
+	char *path;
+};
+
 struct C9aux {
 	int rfd, wfd;
-	uint8_t rbuf[BUFSIZE], *rpos, *rend;
-	uint8_t wbuf[BUFSIZE], *wpos, *wend;
+	int conn;  /* connection number in session recordings */
+	uint32_t msize;   /* msize to request, BUFSIZE if 0 */
+	size_t maxwrite;  /* largest single write(2), unlimited if 0 */
+	size_t bufsize;
+	uint8_t *rbuf, *rpos, *rend;
+	struct wqueue wq[NQUEUE], *partial;
+	int txq;
+	uint8_t *bulkfid;  /* whether writes to each fid are bulk */
+	size_t bulkfidlen;
+	int bulk;
 	char err[128];
 	struct numtab tag;
 	struct numtab fid;
+	struct walked walked[8];
+	int walkednext;
 	struct reply *queue;
 	int ready;
 	struct callback *cb;
 	size_t cblen;
 	struct wl_event_source *idle;
+	struct fsstats stats;
 };
 
 int fsinit(C9ctx *ctx, C9aux *aux);
 void fsasync(C9ctx *ctx, C9tag tag, void (*fn)(C9r *, void *), void *aux);
 C9r *fswait(C9ctx *ctx, C9tag tag, C9rtype type);
+uint64_t fstime(C9r *r);
 void fsreadR(C9ctx *ctx);
+/* messages are only queued until fswriteT or a synchronous fswait */
 void fswriteT(C9ctx *ctx);
+int fspending(C9ctx *ctx);
+void fsbulk(C9ctx *ctx, int fid, int on);
 void fsdispatch(C9ctx *ctx);
+void fsstats(C9ctx *ctx, FILE *f);
 
 int fsflush(C9ctx *ctx, C9tag oldtag);
 int fsattach(C9ctx *ctx, const char *aname);
@@ -29,4 +83,6 @@ int fswalk(C9ctx *ctx, C9tag *tagp, int fid, const char *path[]);
 int fsopen(C9ctx *ctx, C9tag *tagp, int fid, C9mode mode);
 int fsread(C9ctx *ctx, C9tag *tagp, C9r **rp, int fid, uint64_t off, uint32_t len);
 int fswrite(C9ctx *ctx, C9tag *tagp, int fid, uint64_t off, const void *buf, uint32_t len);
-int fsclunk(C9ctx *ctx, int fid);
+int fsstat(C9ctx *ctx, C9tag *tagp, C9r **rp, int fid);
+int fsclunk(C9ctx *ctx, C9tag *tagp, int fid);
+int fsopenpath(C9ctx *ctx, int root, const char *path[], C9mode mode);
@@ -0,0 +1,480 @@
+/* SPDX-License-Identifier: ISC */
+/* microbench: time c9 encoding and decoding and the fs.c reply path */
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "arg.h"
+#include "c9.h"
+#include "util.h"
+#include "fs.h"
+
+#define MOUSELEN 49
+#define DRAWLEN (BUFSIZE - IOHDRSZ)
+
+/* allocations are counted with ld --wrap */
+void *__real_malloc(size_t);
+void *__real_calloc(size_t, size_t);
+void *__real_realloc(void *, size_t);
+
+static uint64_t allocs;
+static long iters = 100000;
+static const char *filter;
+
+void *
+__wrap_malloc(size_t n)
+{
+	++allocs;
+	return __real_malloc(n);
+}
+
+void *
+__wrap_calloc(size_t n, size_t m)
+{
+	++allocs;
+	return __real_calloc(n, m);
+}
+
+void *
+__wrap_realloc(void *p, size_t n)
+{
+	++allocs;
+	return __real_realloc(p, n);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: microbench [-n iterations] [name]\n");
+	exit(1);
+}
+
+static void
+report(const char *name, uint64_t ops, uint64_t ns, uint64_t nalloc)
+{
+	printf("bench=%s ops=%"PRIu64" ns_per_op=%.1f allocs_per_op=%.2f\n",
+		name, ops, (double)ns / ops, (double)nalloc / ops);
+}
+
+static int
+want(const char *name)
+{
+	return !filter || strncmp(name, filter, strlen(filter)) == 0;
+}
+
+/*
+ * A context that encodes into and decodes from aux's buffers,
+ * without any I/O or tag bookkeeping.
+ */
+static C9error
+memnewtag(C9ctx *ctx, C9ttype type, C9tag *tag)
+{
+	*tag = 0;
+	return 0;
+}
+
+static void
+memfreetag(C9ctx *ctx, C9tag tag)
+{
+}
+
+static uint8_t *
+memread(C9ctx *ctx, uint32_t size, int *err)
+{
+	C9aux *aux;
+	uint8_t *p;
+
+	aux = ctx->aux;
+	if (aux->rend - aux->rpos < size) {
+		*err = 0;
+		return NULL;
+	}
+	p = aux->rpos;
+	aux->rpos += size;
+	return p;
+}
+
+static uint8_t *
+membegin(C9ctx *ctx, uint32_t size)
+{
+	return ctx->aux->wq[QCTL].buf;
+}
+
+static int
+memend(C9ctx *ctx)
+{
+	return 0;
+}
+
+static uint64_t nreplies;
+
+static void
+memr(C9ctx *ctx, C9r *r)
+{
+	++nreplies;
+}
+
+static void
+memerror(C9ctx *ctx, const char *fmt, ...)
+{
+	fprintf(stderr, "microbench: c9 error: %s\n", fmt);
+	exit(1);
+}
+
+static void
+meminit(C9ctx *ctx, C9aux *aux)
+{
+	memset(ctx, 0, sizeof *ctx);
+	ctx->newtag = memnewtag;
+	ctx->freetag = memfreetag;
+	ctx->read = memread;
+	ctx->begin = membegin;
+	ctx->end = memend;
+	ctx->r = memr;
+	ctx->error = memerror;
+	ctx->aux = aux;
+	ctx->msize = BUFSIZE;
+	aux->rpos = aux->rend = aux->rbuf;
+}
+
+/* append an R-message with the given body to buf */
+static uint8_t *
+putR(uint8_t *p, int type, int tag, const void *body, size_t len)
+{
+	p = putle32(p, 4 + 1 + 2 + len);
+	*p++ = type;
+	p = putle16(p, tag);
+	memcpy(p, body, len);
+	return p + len;
+}
+
+static uint8_t *
+putRread(uint8_t *p, int tag, uint32_t len)
+{
+	uint8_t body[4 + MOUSELEN];
+
+	putle32(body, len);
+	memset(body + 4, 'm', len);
+	return putR(p, Rread, tag, body, 4 + len);
+}
+
+static uint8_t *
+putRwrite(uint8_t *p, int tag, uint32_t len)
+{
+	uint8_t body[4];
+
+	putle32(body, len);
+	return putR(p, Rwrite, tag, body, 4);
+}
+
+static void
+benchencode(C9aux *aux)
+{
+	static uint8_t data[DRAWLEN];
+	C9ctx ctx;
+	C9tag tag;
+	uint64_t t, a;
+	long i;
+
+	meminit(&ctx, aux);
+	if (want("c9read")) {
+		a = allocs;
+		t = nsec();
+		for (i = 0; i < iters; ++i)
+			c9read(&ctx, &tag, 1, 0, MOUSELEN);
+		report("c9read", iters, nsec() - t, allocs - a);
+	}
+	if (want("c9write-32k")) {
+		a = allocs;
+		t = nsec();
+		for (i = 0; i < iters; ++i)
+			c9write(&ctx, &tag, 1, 0, data, DRAWLEN);
+		report("c9write-32k", iters, nsec() - t, allocs - a);
+	}
+}
+
+static void
+benchdecode(C9aux *aux)
+{
+	C9ctx ctx;
+	uint8_t *p;
+	uint64_t t, a, n;
+	long i;
+
+	meminit(&ctx, aux);
+	if (want("c9proc-rread")) {
+		for (p = aux->rbuf, n = 0; p + 60 <= aux->rbuf + aux->bufsize; ++n)
+			p = putRread(p, 0, MOUSELEN);
+		a = allocs;
+		t = nsec();
+		nreplies = 0;
+		for (i = 0; i < iters; i += n) {
+			aux->rpos = aux->rbuf;
+			aux->rend = p;
+			while (aux->rpos < aux->rend)
+				c9proc(&ctx);
+		}
+		report("c9proc-rread", nreplies, nsec() - t, allocs - a);
+	}
+	if (want("c9proc-rwrite")) {
+		for (p = aux->rbuf, n = 0; p + 11 <= aux->rbuf + aux->bufsize; ++n)
+			p = putRwrite(p, 0, DRAWLEN);
+		a = allocs;
+		t = nsec();
+		nreplies = 0;
+		for (i = 0; i < iters; i += n) {
+			aux->rpos = aux->rbuf;
+			aux->rend = p;
+			while (aux->rpos < aux->rend)
+				c9proc(&ctx);
+		}
+		report("c9proc-rwrite", nreplies, nsec() - t, allocs - a);
+	}
+}
+
+static void
+benchnumtab(void)
+{
+	static const int depth[] = {16, 1024};
+	struct numtab tab = {0};
+	char name[32];
+	uint64_t t, a, ops;
+	long i;
+	int j, k;
+
+	for (k = 0; k < LEN(depth); ++k) {
+		snprintf(name, sizeof name, "numtab-%d", depth[k]);
+		if (!want(name))
+			continue;
+		a = allocs;
+		t = nsec();
+		for (i = 0, ops = 0; i < iters; i += depth[k]) {
+			for (j = 0; j < depth[k]; ++j)
+				numget(&tab);
+			for (j = depth[k] - 1; j >= 0; --j)
+				numput(&tab, j);
+			ops += depth[k];
+		}
+		report(name, ops, nsec() - t, allocs - a);
+	}
+}
+
+static void
+benchblend(void)
+{
+	static uint32_t src[1024], dst[1024];
+	uint64_t t, a;
+	long i;
+	int j;
+
+	if (!want("blend-1k"))
+		return;
+	/* translucent, with some fully opaque and clear runs */
+	for (j = 0; j < LEN(src); ++j)
+		src[j] = j % 64 < 16 ? 0xff204060 : j % 64 < 32 ? 0 : 0x80102030;
+	a = allocs;
+	t = nsec();
+	for (i = 0; i < iters; ++i)
+		blend(dst, src, LEN(src));
+	report("blend-1k", iters, nsec() - t, allocs - a);
+}
+
+static void
+benchscale(void)
+{
+	static uint32_t src[256 * 256], dst[1024];
+	struct scaler sc;
+	uint64_t t, a;
+	long i;
+
+	if (!want("scale-1k"))
+		return;
+	/* a 256x256 image scaled to 1000x1000, not a whole multiple */
+	for (i = 0; i < LEN(src); ++i)
+		src[i] = i * 0x01030507;
+	sc.data = (unsigned char *)src;
+	sc.stride = 256 * 4;
+	sc.x0 = sc.y0 = 0;
+	sc.x1 = sc.y1 = 256;
+	sc.dx = sc.dy = (256 << 16) / 1000;
+	sc.sx = sc.sy = sc.dx / 2 - 0x8000;
+	sc.nearest = 0;
+	a = allocs;
+	t = nsec();
+	for (i = 0; i < iters; ++i)
+		scalerow(&sc, dst, 0, 1000, i % 1000);
+	report("scale-1k", iters, nsec() - t, allocs - a);
+}
+
+static void
+benchbox(void)
+{
+	static uint32_t src[2048 * 2], dst[1024];
+	uint64_t t, a;
+	long i;
+
+	if (!want("box-1k"))
+		return;
+	/* two rows of a 2048 pixel wide buffer at scale 2 */
+	for (i = 0; i < LEN(src); ++i)
+		src[i] = i * 0x01030507;
+	a = allocs;
+	t = nsec();
+	for (i = 0; i < iters; ++i)
+		boxrow(dst, (unsigned char *)src, 2048 * 4, 1024, 2);
+	report("box-1k", iters, nsec() - t, allocs - a);
+}
+
+static int sink;
+
+static void
+fsnop(C9r *r, void *data)
+{
+	++sink;
+}
+
+static void
+writeall(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t ret;
+
+	for (; len > 0; buf += ret, len -= ret) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			perror("write");
+			exit(1);
+		}
+	}
+}
+
+/*
+ * Issue depth requests, then feed their replies through a pipe
+ * and dispatch them, as wl9 does for mouse reads and draw writes.
+ * The pipe write is not timed.
+ */
+static void
+benchfs(C9ctx *ctx, int fd, const char *name, int depth, int draw)
+{
+	static uint8_t data[DRAWLEN], replies[64 * 1024];
+	uint8_t *p;
+	uint64_t t, ns, a, ops;
+	C9tag tag;
+	long i;
+	int j;
+
+	if (!want(name))
+		return;
+	for (p = replies, j = 0; j < depth; ++j)
+		p = draw ? putRwrite(p, j, DRAWLEN) : putRread(p, j, MOUSELEN);
+	a = allocs;
+	ns = 0;
+	for (i = 0, ops = 0; i < iters; i += depth) {
+		t = nsec();
+		for (j = 0; j < depth; ++j) {
+			if ((draw ? fswrite(ctx, &tag, 1, 0, data, DRAWLEN) : fsread(ctx, &tag, NULL, 1, 0, MOUSELEN)) != 0) {
+				fprintf(stderr, "microbench: %s failed\n", name);
+				exit(1);
+			}
+			fsasync(ctx, tag, fsnop, NULL);
+		}
+		fswriteT(ctx);
+		ns += nsec() - t;
+		writeall(fd, replies, p - replies);
+		t = nsec();
+		fsreadR(ctx);
+		fsdispatch(ctx);
+		ns += nsec() - t;
+		ops += depth;
+	}
+	report(name, ops, ns, allocs - a);
+}
+
+static void
+benchwait(C9ctx *ctx, int fd)
+{
+	uint8_t reply[64], *p;
+	uint64_t t, ns, a;
+	C9r *r;
+	long i;
+
+	if (!want("fswait"))
+		return;
+	p = putRread(reply, 0, MOUSELEN);
+	a = allocs;
+	ns = 0;
+	for (i = 0; i < iters; ++i) {
+		/* the reply is already waiting, so fswait never blocks */
+		writeall(fd, reply, p - reply);
+		t = nsec();
+		if (fsread(ctx, NULL, &r, 1, 0, MOUSELEN) != 0) {
+			fprintf(stderr, "microbench: fswait failed\n");
+			exit(1);
+		}
+		free(r);
+		ns += nsec() - t;
+	}
+	report("fswait", iters, ns, allocs - a);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static C9aux aux;
+	C9ctx ctx;
+	uint8_t version[4 + 2 + 6], buf[32], *p;
+	int fd[2];
+	char *end;
+
+	ARGBEGIN {
+	case 'n':
+		iters = strtol(EARGF(usage()), &end, 10);
+		if (*end || iters <= 0)
+			usage();
+		break;
+	default:
+		usage();
+	} ARGEND
+	if (argc > 1)
+		usage();
+	if (argc == 1)
+		filter = argv[0];
+
+	/* fs.c writes to /dev/null and reads replies from a pipe */
+	if (pipe(fd) != 0) {
+		perror("pipe");
+		return 1;
+	}
+	aux.rfd = fd[0];
+	aux.wfd = open("/dev/null", O_WRONLY);
+	if (aux.wfd < 0) {
+		perror("open /dev/null");
+		return 1;
+	}
+	p = putle32(version, BUFSIZE);
+	p = putle16(p, 6);
+	memcpy(p, "9P2000", 6);
+	p = putR(buf, Rversion, 0, version, sizeof version);
+	writeall(fd[1], buf, p - buf);
+	memset(&ctx, 0, sizeof ctx);
+	if (fsinit(&ctx, &aux) != 0)
+		return 1;
+
+	/* the c9 benchmarks share aux's buffers */
+	benchencode(&aux);
+	benchdecode(&aux);
+	benchnumtab();
+	benchblend();
+	benchscale();
+	benchbox();
+	benchfs(&ctx, fd[1], "fs-mouse-1", 1, 0);
+	benchfs(&ctx, fd[1], "fs-mouse-64", 64, 0);
+	benchfs(&ctx, fd[1], "fs-mouse-1024", 1024, 0);
+	fsbulk(&ctx, 1, 1);
+	benchfs(&ctx, fd[1], "fs-draw-8", 8, 1);
+	benchwait(&ctx, fd[1]);
+	return 0;
+}
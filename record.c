@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: ISC */
+#include <stdint.h>
+#include <stdio.h>
+#include "util.h"
+#include "record.h"
+
+static FILE *rec;
+static uint64_t start;
+
+int
+recopen(const char *path)
+{
+	rec = fopen(path, "w");
+	if (!rec) {
+		perror("open session");
+		return -1;
+	}
+	/* records are small, so buffer generously */
+	setvbuf(rec, NULL, _IOFBF, 1 << 20);
+	fputs(RECMAGIC, rec);
+	start = nsec();
+	return 0;
+}
+
+/* whether a session is being recorded */
+int
+recording(void)
+{
+	return rec != NULL;
+}
+
+static void
+rechdr(int type, size_t len)
+{
+	unsigned char hdr[RECHDRSZ];
+
+	hdr[0] = type;
+	putle64(hdr + 1, nsec() - start);
+	putle32(hdr + 9, len);
+	fwrite(hdr, 1, sizeof hdr, rec);
+}
+
+void
+recdata(int type, int conn, const void *buf, size_t len)
+{
+	if (!rec)
+		return;
+	rechdr(type, 1 + len);
+	fputc(conn, rec);
+	fwrite(buf, 1, len, rec);
+}
+
+void
+reccommit(uint32_t id, int width, int height, const int r[4], const unsigned char *img, size_t stride)
+{
+	unsigned char buf[28], *pos;
+	int x0, y0, x1, y1, y;
+
+	if (!rec)
+		return;
+	x0 = r[0] < 0 ? 0 : r[0];
+	y0 = r[1] < 0 ? 0 : r[1];
+	x1 = r[2] > width ? width : r[2];
+	y1 = r[3] > height ? height : r[3];
+	if (x0 >= x1 || y0 >= y1)
+		return;
+	rechdr(RECCOMMIT, sizeof buf + (size_t)(x1 - x0) * (y1 - y0) * 4);
+	pos = putle32(buf, id);
+	pos = putle32(pos, width);
+	pos = putle32(pos, height);
+	pos = putle32(pos, x0);
+	pos = putle32(pos, y0);
+	pos = putle32(pos, x1);
+	putle32(pos, y1);
+	fwrite(buf, 1, sizeof buf, rec);
+	img += y0 * stride + x0 * 4;
+	for (y = y0; y < y1; ++y, img += stride)
+		fwrite(img, 4, x1 - x0, rec);
+}
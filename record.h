@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: ISC */
+
+/*
+ * Session recording. A recording starts with the line RECMAGIC,
+ * followed by records of the form
+ *
+ *	type[1] time[8] len[4] data[len]
+ *
+ * with integers in little-endian byte order, and time in nanoseconds
+ * since the recording started.
+ */
+#define RECMAGIC "wl9 session 1\n"
+#define RECHDRSZ 13
+
+enum {
+	RECREAD = 'r',    /* conn[1] bytes read from 9p connection conn */
+	RECWRITE = 'w',   /* conn[1] bytes written to 9p connection conn */
+	/* id[4] width[4] height[4] x0[4] y0[4] x1[4] y1[4] pixels[4*(x1-x0)*(y1-y0)] */
+	RECCOMMIT = 'c',
+};
+
+int recopen(const char *path);
+int recording(void);
+void recdata(int type, int conn, const void *buf, size_t len);
+void reccommit(uint32_t id, int width, int height, const int r[4], const unsigned char *img, size_t stride);
@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: ISC */
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "util.h"
+#include "trace.h"
+
+#define TRACELEN 65536
+
+struct span {
+	const char *name;
+	uint64_t start, end;
+};
+
+/* wl9 is single-threaded, so one ring serves as the per-thread buffer */
+static struct span *ring;
+static uint64_t ringpos;
+
+void
+traceadd(const char *name, uint64_t start)
+{
+	struct span *s;
+
+	if (!ring) {
+		ring = calloc(TRACELEN, sizeof *ring);
+		if (!ring)
+			return;
+	}
+	s = &ring[ringpos++ % TRACELEN];
+	s->name = name;
+	s->start = start;
+	s->end = nsec();
+}
+
+int
+tracewrite(const char *path)
+{
+	FILE *f;
+	struct span *s;
+	uint64_t i, dur;
+	const char *sep;
+
+	f = fopen(path, "w");
+	if (!f) {
+		perror("open trace");
+		return -1;
+	}
+	fputs("{\"traceEvents\":[", f);
+	sep = "\n";
+	i = ringpos > TRACELEN ? ringpos - TRACELEN : 0;
+	for (; i < ringpos; ++i) {
+		s = &ring[i % TRACELEN];
+		dur = s->end - s->start;
+		fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+			"\"ts\":%"PRIu64".%03d,\"dur\":%"PRIu64".%03d}", sep, s->name,
+			s->start / 1000, (int)(s->start % 1000), dur / 1000, (int)(dur % 1000));
+		sep = ",\n";
+	}
+	fputs("\n],\"displayTimeUnit\":\"ns\"}\n", f);
+	if (fclose(f) != 0) {
+		perror("write trace");
+		return -1;
+	}
+	return 0;
+}
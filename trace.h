@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: ISC */
+
+/*
+ * Timeline tracing, compiled in with -D TRACE. Spans are recorded
+ * into a ring buffer and written out in Chrome trace event format.
+ */
+#ifdef TRACE
+#define TRACEBEGIN(t) uint64_t t = nsec()
+#define TRACEEND(t, name) traceadd(name, t)
+#else
+#define TRACEBEGIN(t) ((void)0)
+#define TRACEEND(t, name) ((void)0)
+#endif
+
+void traceadd(const char *name, uint64_t start);
+int tracewrite(const char *path);
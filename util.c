@@ -1,35 +1,70 @@
 /* SPDX-License-Identifier: ISC */
+#define _POSIX_C_SOURCE 200809L
 #include <assert.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "util.h"
 
 #define ENTBIT (sizeof *((struct numtab *)0)->ent * CHAR_BIT)
 
-int
-numget(struct numtab *tab)
+/*
+ * Set bits in ent mark free numbers, and set bits in sum mark the
+ * words of ent that have any, so the lowest free number is found
+ * with two ctz, scanning one summary word per 4096 numbers.
+ */
+static int
+numgrow(struct numtab *tab)
 {
-	unsigned long *ent, mask;
-	int num;
+	unsigned long *ent, *sum;
+	size_t i, len, sumlen;
 
-	for (ent = tab->ent; ent < tab->ent + tab->len; ent++) {
-		if (*ent) {
-			num = (ent - tab->ent) * ENTBIT;
-			for (mask = *ent; (mask & 1) == 0; mask >>= 1)
-				++num;
-			*ent &= ~(1ul << num);
-			return num;
-		}
-	}
-	ent = realloc(tab->ent, (tab->len + 1) * sizeof *ent);
+	len = tab->len ? tab->len * 2 : 1;
+	sumlen = (len + ENTBIT - 1) / ENTBIT;
+	if (len > INT_MAX / ENTBIT)
+		return -1;
+	ent = realloc(tab->ent, len * sizeof *ent);
 	if (!ent)
 		return -1;
 	tab->ent = ent;
-	ent += tab->len;
-	*ent = -2ul;
-	num = tab->len * ENTBIT;
-	++tab->len;
-	return num;
+	sum = realloc(tab->sum, sumlen * sizeof *sum);
+	if (!sum)
+		return -1;
+	tab->sum = sum;
+	for (i = (tab->len + ENTBIT - 1) / ENTBIT; i < sumlen; ++i)
+		sum[i] = 0;
+	for (i = tab->len; i < len; ++i) {
+		ent[i] = -1ul;
+		sum[i / ENTBIT] |= 1ul << i % ENTBIT;
+	}
+	tab->len = len;
+	return 0;
+}
+
+int
+numget(struct numtab *tab)
+{
+	size_t i, sumlen;
+	int bit;
+
+	sumlen = (tab->len + ENTBIT - 1) / ENTBIT;
+	for (i = 0; i < sumlen && !tab->sum[i]; ++i)
+		;
+	if (i == sumlen) {
+		/* all words are in use, so the first new one is found */
+		i = tab->len / ENTBIT;
+		if (numgrow(tab) != 0)
+			return -1;
+	}
+	i = i * ENTBIT + __builtin_ctzl(tab->sum[i]);
+	bit = __builtin_ctzl(tab->ent[i]);
+	tab->ent[i] &= tab->ent[i] - 1;
+	if (!tab->ent[i])
+		tab->sum[i / ENTBIT] &= ~(1ul << i % ENTBIT);
+	return i * ENTBIT + bit;
 }
 
 int
@@ -45,6 +80,7 @@ numput(struct numtab *tab, int num)
 	if (index >= tab->len || tab->ent[index] & mask)
 		return -1;
 	tab->ent[index] |= mask;
+	tab->sum[index / ENTBIT] |= 1ul << index % ENTBIT;
 	return 0;
 }
 
@@ -85,3 +121,285 @@ utf8dec(uint_least32_t *c, const unsigned char *s, size_t n)
 	*c = x;
 	return l;
 }
+
+/* monotonic time in nanoseconds */
+uint64_t
+nsec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		return 0;
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static unsigned
+histbucket(uint64_t v)
+{
+	unsigned e;
+
+	if (v < 16)
+		return v;
+	for (e = 4; v >> e + 1; ++e)
+		;
+	e = 16 + (e - 4) * 8 + (v >> e - 3 & 7);
+	return e < HISTBUCKETS ? e : HISTBUCKETS - 1;
+}
+
+/* upper bound of the values in bucket i */
+static uint64_t
+histvalue(unsigned i)
+{
+	unsigned e;
+
+	if (i < 16)
+		return i;
+	e = (i - 16) / 8 + 4;
+	return (8ull + (i - 16) % 8 + 1 << e - 3) - 1;
+}
+
+void
+histadd(struct hist *h, uint64_t v)
+{
+	++h->bucket[histbucket(v)];
+	++h->n;
+}
+
+uint64_t
+histpct(const struct hist *h, unsigned pct)
+{
+	uint64_t n, want;
+	unsigned i;
+
+	if (h->n == 0)
+		return 0;
+	want = (h->n * pct + 99) / 100;
+	n = 0;
+	for (i = 0; i < HISTBUCKETS; ++i) {
+		n += h->bucket[i];
+		if (n >= want)
+			break;
+	}
+	return histvalue(i);
+}
+
+/* d * a / 255, rounded, for d, a <= 255 */
+static inline unsigned
+mul255(unsigned d, unsigned a)
+{
+	d = d * a + 128;
+	return d + (d >> 8) >> 8;
+}
+
+/* composite n premultiplied ARGB pixels from src over dst */
+void
+blend(uint32_t *dst, const uint32_t *src, size_t n)
+{
+	uint32_t s, d, r;
+	unsigned a, c, j;
+	size_t i;
+
+	i = 0;
+#ifdef __SSE2__
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i round = _mm_set1_epi16(128);
+		const __m128i full = _mm_set1_epi16(255);
+		const __m128i opaque = _mm_set1_epi32(0xff000000);
+		__m128i vs, vd, sa, lo, hi, alo, ahi;
+		int m;
+
+		for (; i + 4 <= n; i += 4) {
+			vs = _mm_loadu_si128((const __m128i *)(src + i));
+			sa = _mm_and_si128(vs, opaque);
+			m = _mm_movemask_epi8(_mm_cmpeq_epi32(sa, opaque));
+			if (m == 0xffff) {
+				_mm_storeu_si128((__m128i *)(dst + i), vs);
+				continue;
+			}
+			if (_mm_movemask_epi8(_mm_cmpeq_epi32(vs, zero)) == 0xffff)
+				continue;
+			vd = _mm_loadu_si128((const __m128i *)(dst + i));
+			/* 255 - alpha, broadcast to each 16-bit channel */
+			lo = _mm_unpacklo_epi8(vs, zero);
+			hi = _mm_unpackhi_epi8(vs, zero);
+			alo = _mm_sub_epi16(full, _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xff), 0xff));
+			ahi = _mm_sub_epi16(full, _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0xff), 0xff));
+			lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(vd, zero), alo), round);
+			hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(vd, zero), ahi), round);
+			lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+			hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+			vd = _mm_adds_epu8(_mm_packus_epi16(lo, hi), vs);
+			_mm_storeu_si128((__m128i *)(dst + i), vd);
+		}
+	}
+#endif
+	for (; i < n; ++i) {
+		s = src[i];
+		a = 255 - (s >> 24);
+		if (a == 0) {
+			dst[i] = s;
+			continue;
+		}
+		d = dst[i];
+		r = 0;
+		for (j = 0; j < 32; j += 8) {
+			c = (s >> j & 0xff) + mul255(d >> j & 0xff, a);
+			r |= (uint32_t)(c > 255 ? 255 : c) << j;
+		}
+		dst[i] = r;
+	}
+}
+
+/* a and b mixed per channel, with b weighted by f / 256 */
+static inline uint32_t
+lerp(uint32_t a, uint32_t b, unsigned f)
+{
+	uint32_t rb, ag;
+
+	rb = ((a & 0xff00ff) * (256 - f) + (b & 0xff00ff) * f) >> 8 & 0xff00ff;
+	ag = ((a >> 8 & 0xff00ff) * (256 - f) + (b >> 8 & 0xff00ff) * f) & 0xff00ff00;
+	return rb | ag;
+}
+
+#ifdef __SSE2__
+/* lerp of four pixels, with weights per pixel in flo and fhi */
+static inline __m128i
+lerp4(__m128i a, __m128i b, __m128i flo, __m128i fhi)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi16(256);
+	__m128i lo, hi;
+
+	lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), _mm_sub_epi16(one, flo)),
+		_mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), flo));
+	hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), _mm_sub_epi16(one, fhi)),
+		_mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), fhi));
+	return _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+}
+#endif
+
+/* the pixel at or before p within lo..hi, and the weight of the next */
+static inline int
+sample(int64_t p, int lo, int hi, unsigned *f)
+{
+	int i;
+
+	if (p < (int64_t)lo << 16)
+		p = (int64_t)lo << 16;
+	i = p >> 16;
+	*f = p >> 8 & 0xff;
+	if (i >= hi - 1) {
+		i = hi - 1;
+		*f = 0;
+	}
+	return i;
+}
+
+/*
+ * Scale row y, pixels x0 to x1, of the destination of s into dst.
+ * Bilinear filtering reads two rows and two columns per pixel; the
+ * weights are 8-bit, and each channel is mixed separately.
+ */
+void
+scalerow(const struct scaler *s, uint32_t *dst, int x0, int x1, int y)
+{
+	const uint32_t *r0, *r1;
+	int64_t p;
+	unsigned fx, fy;
+	int i, j, k;
+
+	p = s->sy + y * s->dy;
+	if (s->nearest) {
+		r0 = (const uint32_t *)(s->data + sample(p + 0x8000, s->y0, s->y1, &fy) * s->stride);
+		for (i = x0; i < x1; ++i)
+			*dst++ = r0[sample(s->sx + i * s->dx + 0x8000, s->x0, s->x1, &fx)];
+		return;
+	}
+	j = sample(p, s->y0, s->y1, &fy);
+	r0 = (const uint32_t *)(s->data + j * s->stride);
+	r1 = fy ? (const uint32_t *)((const unsigned char *)r0 + s->stride) : r0;
+	i = x0;
+#ifdef __SSE2__
+	{
+		unsigned f[4];
+		int c[4], n[4];
+		__m128i top, bot, flo, fhi, vfy;
+
+		vfy = _mm_set1_epi16(fy);
+		for (; i + 4 <= x1; i += 4) {
+			for (k = 0; k < 4; ++k) {
+				c[k] = sample(s->sx + (i + k) * s->dx, s->x0, s->x1, &f[k]);
+				n[k] = c[k] + (f[k] != 0);
+			}
+			flo = _mm_set_epi16(f[1], f[1], f[1], f[1], f[0], f[0], f[0], f[0]);
+			fhi = _mm_set_epi16(f[3], f[3], f[3], f[3], f[2], f[2], f[2], f[2]);
+			top = lerp4(_mm_set_epi32(r0[c[3]], r0[c[2]], r0[c[1]], r0[c[0]]),
+				_mm_set_epi32(r0[n[3]], r0[n[2]], r0[n[1]], r0[n[0]]), flo, fhi);
+			bot = lerp4(_mm_set_epi32(r1[c[3]], r1[c[2]], r1[c[1]], r1[c[0]]),
+				_mm_set_epi32(r1[n[3]], r1[n[2]], r1[n[1]], r1[n[0]]), flo, fhi);
+			_mm_storeu_si128((__m128i *)dst, lerp4(top, bot, vfy, vfy));
+			dst += 4;
+		}
+	}
+#endif
+	for (; i < x1; ++i) {
+		j = sample(s->sx + i * s->dx, s->x0, s->x1, &fx);
+		k = j + (fx != 0);
+		*dst++ = lerp(lerp(r0[j], r0[k], fx), lerp(r1[j], r1[k], fx), fy);
+	}
+}
+
+/*
+ * Average k x k blocks of src, whose rows are stride bytes apart,
+ * into n pixels of dst, for k up to 16. Two channels are summed
+ * per 32-bit word; SSE2 handles k = 2 four pixels at a time.
+ */
+void
+boxrow(uint32_t *dst, const unsigned char *src, size_t stride, size_t n, int k)
+{
+	const uint32_t *row;
+	uint32_t rb, ag;
+	unsigned kk, h;
+	size_t i;
+	int x, y;
+
+	i = 0;
+#ifdef __SSE2__
+	if (k == 2) {
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i two = _mm_set1_epi16(2);
+		const uint32_t *r0 = (const uint32_t *)src;
+		const uint32_t *r1 = (const uint32_t *)(src + stride);
+		__m128i a, b, lo, hi, s[2];
+		int j;
+
+		for (; i + 4 <= n; i += 4) {
+			for (j = 0; j < 2; ++j) {
+				a = _mm_loadu_si128((const __m128i *)(r0 + 2 * i + 4 * j));
+				b = _mm_loadu_si128((const __m128i *)(r1 + 2 * i + 4 * j));
+				lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+				hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+				/* add horizontally adjacent pixels */
+				s[j] = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+				s[j] = _mm_srli_epi16(_mm_add_epi16(s[j], two), 2);
+			}
+			_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(s[0], s[1]));
+		}
+	}
+#endif
+	kk = k * k;
+	h = kk / 2;
+	for (; i < n; ++i) {
+		rb = ag = 0;
+		for (y = 0; y < k; ++y) {
+			row = (const uint32_t *)(src + y * stride) + i * k;
+			for (x = 0; x < k; ++x) {
+				rb += row[x] & 0xff00ff;
+				ag += row[x] >> 8 & 0xff00ff;
+			}
+		}
+		dst[i] = ((rb & 0xffff) + h) / kk | ((rb >> 16) + h) / kk << 16
+			| ((ag & 0xffff) + h) / kk << 8 | ((ag >> 16) + h) / kk << 24;
+	}
+}
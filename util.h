@@ -3,17 +3,47 @@
 #include <stdint.h>
 
 #define LEN(a) (sizeof (a) / sizeof *(a))
+#define HISTBUCKETS 256
 
 struct numtab {
-	unsigned long *ent;
+	unsigned long *ent, *sum;
 	size_t len;
 };
 
+/* log-linear histogram with ~12% resolution */
+struct hist {
+	uint64_t n;
+	uint32_t bucket[HISTBUCKETS];
+};
+
+/*
+ * A source image mapped onto destination pixels: the centre of
+ * destination pixel x, y samples the source at sx + x * dx,
+ * sy + y * dy (16.16 fixed point), within x0..x1, y0..y1.
+ */
+struct scaler {
+	const unsigned char *data;
+	size_t stride;
+	int x0, y0, x1, y1;
+	int64_t sx, sy;
+	int64_t dx, dy;
+	int nearest;
+};
+
 int numget(struct numtab *tab);
 int numput(struct numtab *tab, int num);
 
 size_t utf8dec(uint_least32_t *c, const unsigned char *s, size_t n);
 
+uint64_t nsec(void);
+
+void histadd(struct hist *h, uint64_t v);
+uint64_t histpct(const struct hist *h, unsigned pct);
+
+void blend(uint32_t *dst, const uint32_t *src, size_t n);
+void scalerow(const struct scaler *s, uint32_t *dst, int x0, int x1, int y);
+void boxrow(uint32_t *dst, const unsigned char *src, size_t stride, size_t n, int k);
+
 static inline void *
 putle16(void *p, unsigned v)
 {
@@ -75,3 +105,11 @@ getle32(void *p)
 	v |= (b[3] & 0xfful) << 24;
 	return v;
 }
+
+static inline unsigned long long
+getle64(void *p)
+{
+	unsigned char *b = p;
+
+	return getle32(b) | (unsigned long long)getle32(b + 4) << 32;
+}
@@ -10,6 +10,7 @@
 #include <time.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <signal.h>
 #include <spawn.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
@@ -20,21 +21,47 @@
 #include "keymap.h"
 #include "util.h"
 #include "fs.h"
+#include "record.h"
+#include "trace.h"
 #include "xdg-shell-server-protocol.h"
 #include "server-decoration-server-protocol.h"
+#include "viewporter-server-protocol.h"
+#include "presentation-time-server-protocol.h"
 
 #define BORDER 4
+#define KBMAPPOLL 2000  /* /dev/kbmap poll interval (ms) */
+#define KBMAPREADS 64   /* maximum outstanding reads of /dev/kbmap */
+#define MAXREADS 8      /* maximum outstanding reads per input file */
+#define SNARFWRITES 4   /* maximum outstanding writes per selection */
+#define SNARFREADS 4    /* maximum outstanding reads per paste */
+#define CURSORCACHE 16  /* converted cursor images to keep */
+#define CURSORRATE 50   /* minimum interval between cursor writes (ms) */
+#define BOXMAX 16       /* largest buffer scale reduced with a box filter */
+#define XRGB32 0x68081828
+#define ARGB32 0x48081828
 
 struct damage {
 	int x0, y0;
 	int x1, y1;
 };
 
+static const struct damage nodamage = {-1, -1, -1, -1};
+
 struct surface_state {
 	struct wl_resource *buffer;
 	struct wl_listener buffer_destroy;
 	struct wl_list callbacks;
+	/* wp_presentation_feedback for this content update */
+	struct wl_list feedback;
 	struct damage damage;
+	/* from damage_buffer, until the commit maps it to the surface */
+	struct damage bufdamage;
+	struct damage opaque;
+	/* viewport source rectangle, srcw -1 if unset */
+	wl_fixed_t srcx, srcy, srcw, srch;
+	/* viewport destination size, dstw -1 if unset */
+	int dstw, dsth;
+	int scale;
 };
 
 struct surface {
@@ -42,10 +69,84 @@ struct surface {
 	struct wl_resource *role;
 	void (*commit)(struct surface *);
 	struct surface_state pending, state;
+	/* committed state of a synchronized subsurface, set if cached */
+	struct surface_state cache;
+	int cached;
+	struct wl_resource *viewport;
+	/* set if the surface is a subsurface */
+	struct subsurface *sub;
+	/* subsurfaces, bottom to top */
+	struct wl_list subsurfaces;
+};
+
+struct subsurface {
+	struct wl_resource *resource;
+	struct surface *surface;
+	struct surface *parent;
+	struct wl_list link;
+	int sync;
+	/* position in the parent, and as of the next parent commit */
+	int x, y;
+	int nextx, nexty;
+	/* buffer size at the last commit */
+	int w, h;
 };
 
 struct region {
 	struct wl_resource *resource;
+	/* the largest rectangle added, which is within the region */
+	struct damage box;
+};
+
+struct window;
+
+struct positioner {
+	int w, h;
+	struct damage anchor;
+	int anchorset;
+	uint32_t edge, gravity, adjust;
+	int dx, dy;
+};
+
+struct popup {
+	struct wl_resource *resource;
+	struct window *w;
+	struct window *parent;
+	int grab;
+	/* position relative to the parent, and size */
+	int x, y;
+	int width, height;
+
+	/* while shown, the toplevel it is drawn on */
+	struct window *top;
+	struct wl_list link;
+	/* rectangle in the toplevel */
+	struct damage r;
+	/* off-screen images of the popup and of what it covers */
+	int image, backing;
+	uint32_t chan;
+};
+
+/* an outstanding read on an input file */
+struct inputread {
+	struct input *in;
+	C9tag tag;
+	int done;
+	uint64_t time;
+	uint32_t size;
+	unsigned char data[256];
+};
+
+/* input file with reads completed in the order they were issued */
+struct input {
+	struct window *w;
+	int fid;
+	uint32_t size;
+	void (*event)(struct window *, unsigned char *, uint32_t, uint64_t);
+	int error;
+	/* ring of outstanding reads */
+	int head, count;
+	struct inputread read[MAXREADS];
 };
 
 struct window {
@@ -53,6 +154,7 @@ struct window {
 	struct wl_resource *xdgsurface;
 	struct wl_resource *toplevel;
 	struct wl_listener surface_destroy;
+	struct wl_list link;
 	uint32_t serial;
 	int initial_commit;
 
@@ -70,42 +172,108 @@ struct window {
 	int wctl;
 	int winname;
 	int label;
-	int mouse;
-	int kbd;
+	int cursor;
+	/* hash of the cursor last written, or 0 for the default */
+	uint64_t cursorhash;
 
 	/* pending i/o tags */
 	C9tag wctltag;
-	C9tag mousetag;
-	C9tag kbdtag;
+
+	/* mouse and kbd reads */
+	struct input mouse;
+	struct input kbd;
 
 	/* /dev/draw image id */
 	int image;
+	/* surface tree flattened, when there are subsurfaces */
+	uint32_t *stage;
+	int stagew, stageh;
+	/* popups shown on a toplevel, bottom to top */
+	struct wl_list popups;
+	/* set if the xdg_surface is a popup */
+	struct popup *popup;
+
+	/* update awaiting acknowledgement, and whether damaged since */
+	struct upload *upload;
+	int redraw;
+
+	/* input-to-photon latency (us) */
+	uint64_t inputtime;
+	uint64_t committime;
+	struct hist commitlat;
+	struct hist photonlat;
 };
 
 struct drawcopy {
 	struct window *w;
-	struct wl_shm_buffer *b;
+	/* destination image and its origin */
+	int image;
+	int ox, oy;
+	/* whether to end with a flush */
+	int flush;
+	/* tag of the last write, -1 if one failed */
+	C9tag tag;
+	unsigned char *img;
+	size_t stride;
 	struct damage d;
 	int x, y;
 	int dx, dy;
 };
 
+/* frame callbacks and feedback of a window update being uploaded */
+struct upload {
+	/* NULL once the window is destroyed */
+	struct window *w;
+	/* whether the update answers the input being measured */
+	int photon;
+	struct wl_list callbacks;
+	struct wl_list feedback;
+};
+
 struct snarfput {
 	int snarf;
 	unsigned long long offset;
+	/* NULL once the client destroys it */
 	struct wl_resource *source;
+	struct wl_listener source_destroy;
 	struct wl_event_source *event;
+	int fd;
+	int writes;  /* in flight */
+	size_t buflen;
+	char buf[];
+};
+
+/* the selection being written to a client's pipe */
+struct snarfsend {
+	struct wl_event_source *event;
+	size_t off, len;
+	char data[];
+};
+
+struct snarfread {
+	struct snarfget *get;
+	unsigned long long off;
 };
 
 struct snarfget {
 	int fd;
-	unsigned long long offset;
 	struct wl_resource *offer;
+	/* qid version of /dev/snarf before reading */
+	int stat;
+	uint32_t vers;
+	struct snarfread rd[SNARFREADS];
+	int reads;  /* in flight */
+	int err;
+	uint32_t readsz;
+	unsigned long long next;  /* offset of the next read */
+	char *data;
+	size_t len, cap;
 };
 
 static struct wl_display *dpy;
 static struct wl_event_loop *evt;
 static struct wl_client *child;
+static struct wl_list windows;
 static const struct wl_data_offer_interface offer_impl;
 static struct {
 	struct wl_list resources;
@@ -113,11 +281,47 @@ static struct {
 static struct {
 	struct wl_list resources;
 } datadev;
+/* /dev/snarf as of the last paste, valid while its qid version is unchanged */
+static struct {
+	char *data;
+	size_t len;
+	int valid;
+	uint32_t vers;
+} snarfcache;
 static struct {
 	struct window *focus;
 	struct wl_list active;
 	struct wl_list inactive;
+
+	/* coalesced motion not yet sent to the focused window */
+	int motion;
+	uint32_t time;
+	uint64_t since;
+	/* coalescing window (ms) */
+	int delay;
+	struct wl_event_source *timer;
 } mouse;
+/* Plan 9 cursor image as written to /dev/cursor */
+struct cursor {
+	uint64_t hash;
+	unsigned char data[72];
+};
+static struct {
+	/* window and surface of the last set_cursor */
+	struct window *w;
+	struct surface *surface;
+	struct wl_listener surface_destroy;
+	int hotx, hoty;
+
+	/* converted images by content hash */
+	struct cursor cache[CURSORCACHE];
+	int cachenext;
+
+	/* time of the last write, and whether one is waiting on it */
+	uint64_t last;
+	int waiting;
+	struct wl_event_source *timer;
+} cursor;
 static struct {
 	struct window *focus;
 	struct wl_list active;
@@ -125,6 +329,13 @@ static struct {
 	uint32_t mods;
 	int keymapfd;
 	size_t keymapsize;
+
+	/* /dev/kbmap fid and last seen stat */
+	int kbmap;
+	uint32_t kbmapvers;
+	uint32_t kbmapmtime;
+	uint64_t kbmaplen;
+	struct wl_event_source *kbmaptimer;
 } kbd;
 static struct {
 	/* root fid */
@@ -138,150 +349,1077 @@ static struct {
 	uint32_t eventmask;
 } term;
 static struct {
+	/* connection for draw data, which may be separate from term */
+	C9ctx *ctx;
+	int root;
+	struct wl_event_source *event;
+	uint32_t eventmask;
+
 	int ctlfid;
 	int datafid;
-	int datafd;
 
 	int x0, y0;
 	int x1, y1;
 	unsigned char *buf;
 	size_t buflen;
 	struct numtab imgid;
+	/* 1x1 opaque mask */
+	int opaque;
 } draw;
 
 static C9aux termaux;
 static C9ctx termctx;
+static C9aux drawaux;
+static C9ctx drawctx;
+static int readdepth = 1;
+static int outscale = 1;
+
+static void
+drawcopy(struct drawcopy *d)
+{
+	int x, y, x0, y0, x1, y1;
+	unsigned char *img, *buf, *pos;
+	size_t n, stride;
+	int done;
+	C9tag tag;
+
+	TRACEBEGIN(span);
+	x = d->x, y = d->y;
+	stride = d->stride;
+	img = d->img + x * 4 + y * stride;
+	buf = draw.buf;
+	*buf++ = 'y';
+	buf = putle32(buf, d->image);
+	tag = -1;
+	for (done = 0; !done;) {
+		x0 = x;
+		x1 = x + d->dx;
+		if (x1 > d->d.x1)
+			x1 = d->d.x1;
+
+		y0 = y;
+		y1 = y + d->dy;
+		if (y1 > d->d.y1)
+			y1 = d->d.y1;
+
+		pos = putle32(buf, d->ox + x0);
+		pos = putle32(pos, d->oy + y0);
+		pos = putle32(pos, d->ox + x1);
+		pos = putle32(pos, d->oy + y1);
+		n = (x1 - x0) * 4;
+		for (; y < y1; ++y)
+			memcpy(pos, img, n), pos += n, img += stride;
+		if (x1 < d->d.x1)
+			x = x1, --y;
+		else
+			x = d->d.x0;
+		if (y == d->d.y1) {
+			done = 1;
+			if (d->flush)
+				*pos++ = 'v';
+		}
+
+		if (fswrite(draw.ctx, &tag, draw.datafid, 0, draw.buf, pos - draw.buf) != 0) {
+			fprintf(stderr, "fswrite %s draw: %s\n", d->w->name, draw.ctx->aux->err);
+			tag = -1;
+			break;
+		}
+	}
+	d->tag = tag;
+	d->x = x;
+	d->y = y;
+	TRACEEND(span, "drawcopy");
+}
+
+/* start a copy of the damage d->d, in chunks that fit draw.buf */
+static void
+drawcopyinit(struct drawcopy *d)
+{
+	size_t n;
+
+	d->x = d->d.x0;
+	d->y = d->d.y0;
+	d->dx = d->d.x1 - d->d.x0;
+	n = draw.buflen - 22;
+	if (n < 4 * d->dx) {
+		d->dx = (4 * d->dx + n - 1) / n;
+		d->dy = 1;
+	} else {
+		d->dy = n / (4 * d->dx);
+	}
+}
+
+/* write the draw messages in draw.buf up to end */
+static unsigned char *
+drawsend(unsigned char *end)
+{
+	if (end > draw.buf && fswrite(draw.ctx, NULL, draw.datafid, 0, draw.buf, end - draw.buf) != 0)
+		fprintf(stderr, "fswrite draw: %s\n", draw.ctx->aux->err);
+	return draw.buf;
+}
+
+/* write the draw messages in draw.buf up to end, without waiting for the reply */
+static unsigned char *
+drawqueue(unsigned char *end)
+{
+	C9tag tag;
+
+	if (fswrite(draw.ctx, &tag, draw.datafid, 0, draw.buf, end - draw.buf) != 0)
+		fprintf(stderr, "fswrite draw: %s\n", draw.ctx->aux->err);
+	return draw.buf;
+}
+
+/* send presented events with time t, as the flush was acknowledged */
+static void
+presented(struct wl_list *feedback, uint64_t t)
+{
+	struct wl_resource *r, *tmp, *out;
+	uint64_t sec;
+
+	sec = t / 1000000000;
+	wl_resource_for_each_safe(r, tmp, feedback) {
+		out = wl_resource_find_for_client(&output.resources, wl_resource_get_client(r));
+		if (out)
+			wp_presentation_feedback_send_sync_output(r, out);
+		wp_presentation_feedback_send_presented(r, sec >> 32, sec, t % 1000000000, 0, 0, 0, 0);
+		wl_resource_destroy(r);
+	}
+}
+
+static void
+discarded(struct wl_list *feedback)
+{
+	struct wl_resource *r, *tmp;
+
+	wl_resource_for_each_safe(r, tmp, feedback) {
+		wp_presentation_feedback_send_discarded(r);
+		wl_resource_destroy(r);
+	}
+}
+
+/* collect the frame callbacks and presentation feedback of the surface tree */
+static void
+treedone(struct surface *s, struct wl_list *callbacks, struct wl_list *feedback)
+{
+	struct subsurface *sub;
+
+	wl_list_insert_list(callbacks, &s->state.callbacks);
+	wl_list_init(&s->state.callbacks);
+	wl_list_insert_list(feedback, &s->state.feedback);
+	wl_list_init(&s->state.feedback);
+	wl_list_for_each(sub, &s->subsurfaces, link)
+		treedone(sub->surface, callbacks, feedback);
+}
+
+static void windraw(struct window *);
+static void popupshow(struct popup *);
+
+/* send the frame callbacks of u, and its feedback presented at t, or discarded if 0 */
+static void
+uploaddone(struct upload *u, uint64_t t)
+{
+	struct wl_resource *r, *tmp;
+
+	wl_resource_for_each_safe(r, tmp, &u->callbacks) {
+		wl_callback_send_done(r, 0);
+		wl_resource_destroy(r);
+	}
+	if (t)
+		presented(&u->feedback, t);
+	else
+		discarded(&u->feedback);
+}
+
+static void
+uploaded(C9r *reply, void *aux)
+{
+	struct upload *u;
+	struct window *w;
+	uint64_t t;
+
+	u = aux;
+	w = u->w;
+	t = fstime(reply);
+	if (reply->type == Rerror) {
+		fprintf(stderr, "fswrite draw: %s\n", reply->error);
+		uploaddone(u, 0);
+	} else {
+		uploaddone(u, t);
+	}
+	if (w) {
+		w->upload = NULL;
+		if (u->photon && w->committime) {
+			histadd(&w->photonlat, (t - w->inputtime) / 1000);
+			w->inputtime = 0;
+			w->committime = 0;
+		}
+	}
+	free(u);
+	if (w && w->redraw) {
+		w->redraw = 0;
+		if (w->popup)
+			popupshow(w->popup);
+		else
+			windraw(w);
+	}
+}
+
+/*
+ * Finish the update of w when the write with tag, which ends with
+ * a flush, is acknowledged. Until then, the window collects further
+ * damage rather than starting another upload.
+ */
+static void
+drawwait(struct window *w, C9tag tag)
+{
+	struct upload *u;
+
+	u = malloc(sizeof *u);
+	if (!u) {
+		perror(NULL);
+		return;
+	}
+	u->w = w;
+	u->photon = w->committime != 0;
+	wl_list_init(&u->callbacks);
+	wl_list_init(&u->feedback);
+	treedone(w->surface, &u->callbacks, &u->feedback);
+	if (tag == -1) {
+		uploaddone(u, 0);
+		free(u);
+		return;
+	}
+	w->upload = u;
+	fsasync(draw.ctx, tag, uploaded, u);
+}
+
+/* write the draw messages in draw.buf up to end, which finish the update of w */
+static void
+drawflush(unsigned char *end, struct window *w)
+{
+	C9tag tag;
+
+	if (fswrite(draw.ctx, &tag, draw.datafid, 0, draw.buf, end - draw.buf) != 0) {
+		fprintf(stderr, "fswrite %s draw: %s\n", w->name, draw.ctx->aux->err);
+		tag = -1;
+	}
+	drawwait(w, tag);
+}
+
+static unsigned char *
+drawb(unsigned char *pos, int id, uint32_t chan, int repl, const int r[4], uint32_t color)
+{
+	static const int huge[4] = {-0x3fffffff, -0x3fffffff, 0x3fffffff, 0x3fffffff};
+	int i;
+
+	*pos++ = 'b';
+	pos = putle32(pos, id);
+	pos = putle32(pos, 0);
+	*pos++ = 0;
+	pos = putle32(pos, chan);
+	*pos++ = repl;
+	for (i = 0; i < 4; ++i)
+		pos = putle32(pos, r[i]);
+	for (i = 0; i < 4; ++i)
+		pos = putle32(pos, repl ? huge[i] : r[i]);
+	return putle32(pos, color);
+}
+
+/* draw r of dst from src at sx, sy */
+static unsigned char *
+drawd(unsigned char *pos, int dst, int src, const int r[4], int sx, int sy)
+{
+	int i;
+
+	*pos++ = 'd';
+	pos = putle32(pos, dst);
+	pos = putle32(pos, src);
+	pos = putle32(pos, draw.opaque);
+	for (i = 0; i < 4; ++i)
+		pos = putle32(pos, r[i]);
+	pos = putle32(pos, sx);
+	pos = putle32(pos, sy);
+	pos = putle32(pos, 0);
+	return putle32(pos, 0);
+}
+
+static unsigned char *
+drawf(unsigned char *pos, int id)
+{
+	*pos++ = 'f';
+	return putle32(pos, id);
+}
+
+/*
+ * Draw the damage d->d of a surface that replicates each pixel of
+ * the source rectangle of sc kx by ky times. Only the source pixels
+ * are uploaded, to a scratch image. Each column is copied to an image
+ * one pixel wide, replicated to draw it kx pixels wide, and then each
+ * row likewise ky pixels high, so the scaling costs 2 * (w + h) draw
+ * messages instead of a kx * ky times larger upload. Returns the end
+ * of the messages left in draw.buf, with d->tag -1 if any failed.
+ */
+static unsigned char *
+drawrepl(struct drawcopy *d, const struct scaler *sc, int kx, int ky)
+{
+	struct drawcopy c;
+	unsigned char *pos, *end;
+	int id[4], need[4], i, u, v, u0, u1, v0, v1, x0, x1, y0, y1, src;
+
+	/* source, column, columns at full width, and row images */
+	need[0] = 1;
+	need[1] = need[2] = kx > 1;
+	need[3] = ky > 1;
+	for (i = 0; i < 4; ++i) {
+		id[i] = need[i] ? numget(&draw.imgid) : -1;
+		if (need[i] && id[i] < 0) {
+			while (--i >= 0) {
+				if (id[i] >= 0)
+					numput(&draw.imgid, id[i]);
+			}
+			fprintf(stderr, "%s: no free image ids\n", d->w->name);
+			d->tag = -1;
+			return draw.buf;
+		}
+	}
+	u0 = d->d.x0 / kx, u1 = (d->d.x1 + kx - 1) / kx;
+	v0 = d->d.y0 / ky, v1 = (d->d.y1 + ky - 1) / ky;
+	src = kx > 1 ? id[2] : id[0];
+	pos = drawb(draw.buf, id[0], XRGB32, 0, (int[]){u0, v0, u1, v1}, 0);
+	if (kx > 1) {
+		pos = drawb(pos, id[1], XRGB32, 1, (int[]){0, v0, 1, v1}, 0);
+		pos = drawb(pos, id[2], XRGB32, 0, (int[]){d->d.x0, v0, d->d.x1, v1}, 0);
+	}
+	if (ky > 1)
+		pos = drawb(pos, id[3], XRGB32, 1, (int[]){d->d.x0, 0, d->d.x1, 1}, 0);
+	drawqueue(pos);
+
+	c.w = d->w;
+	c.image = id[0];
+	c.ox = -sc->x0;
+	c.oy = -sc->y0;
+	c.flush = 0;
+	c.img = (unsigned char *)sc->data;
+	c.stride = sc->stride;
+	c.d.x0 = sc->x0 + u0, c.d.y0 = sc->y0 + v0;
+	c.d.x1 = sc->x0 + u1, c.d.y1 = sc->y0 + v1;
+	drawcopyinit(&c);
+	drawcopy(&c);
+	d->tag = c.tag;
+
+	pos = draw.buf;
+	end = draw.buf + draw.buflen - 2 * 45;
+	for (u = u0; kx > 1 && u < u1; ++u) {
+		if (pos > end)
+			pos = drawqueue(pos);
+		x0 = u * kx > d->d.x0 ? u * kx : d->d.x0;
+		x1 = u * kx + kx < d->d.x1 ? u * kx + kx : d->d.x1;
+		pos = drawd(pos, id[1], id[0], (int[]){0, v0, 1, v1}, u, v0);
+		pos = drawd(pos, id[2], id[1], (int[]){x0, v0, x1, v1}, 0, v0);
+	}
+	if (ky == 1)
+		pos = drawd(pos, d->image, src, (int[]){d->ox + d->d.x0, d->oy + d->d.y0, d->ox + d->d.x1, d->oy + d->d.y1}, d->d.x0, d->d.y0);
+	for (v = v0; ky > 1 && v < v1; ++v) {
+		if (pos > end)
+			pos = drawqueue(pos);
+		y0 = v * ky > d->d.y0 ? v * ky : d->d.y0;
+		y1 = v * ky + ky < d->d.y1 ? v * ky + ky : d->d.y1;
+		pos = drawd(pos, id[3], src, (int[]){d->d.x0, 0, d->d.x1, 1}, d->d.x0, v);
+		pos = drawd(pos, d->image, id[3], (int[]){d->ox + d->d.x0, d->oy + y0, d->ox + d->d.x1, d->oy + y1}, d->d.x0, 0);
+	}
+	if (pos > end)
+		pos = drawqueue(pos);
+	for (i = 0; i < 4; ++i) {
+		if (id[i] >= 0) {
+			pos = drawf(pos, id[i]);
+			numput(&draw.imgid, id[i]);
+		}
+	}
+	return pos;
+}
+
+/* the toplevel under a chain of popups, and w's offset in it */
+static struct window *
+wintop(struct window *w, int *x, int *y)
+{
+	*x = 0, *y = 0;
+	for (; w && w->popup; w = w->popup->parent) {
+		*x += w->popup->x;
+		*y += w->popup->y;
+	}
+	return w && w->toplevel ? w : NULL;
+}
+
+static int
+rectisect(struct damage *c, const struct damage *a, const struct damage *b)
+{
+	c->x0 = a->x0 > b->x0 ? a->x0 : b->x0;
+	c->y0 = a->y0 > b->y0 ? a->y0 : b->y0;
+	c->x1 = a->x1 < b->x1 ? a->x1 : b->x1;
+	c->y1 = a->y1 < b->y1 ? a->y1 : b->y1;
+	return c->x0 < c->x1 && c->y0 < c->y1;
+}
+
+/*
+ * Redraw the popups of top from l upward within d, first saving
+ * what is now beneath them, so they can later be taken down by
+ * drawing from their backing images without another upload.
+ */
+static unsigned char *
+popupsdraw(unsigned char *pos, struct window *top, struct wl_list *l, const struct damage *d)
+{
+	struct popup *p;
+	struct damage c;
+	int r[4];
+
+	for (; l != &top->popups; l = l->next) {
+		p = wl_container_of(l, p, link);
+		if (!rectisect(&c, &p->r, d))
+			continue;
+		if (pos + 2 * 45 + 1 > draw.buf + draw.buflen)
+			pos = drawsend(pos);
+		r[0] = c.x0 - p->r.x0, r[1] = c.y0 - p->r.y0;
+		r[2] = c.x1 - p->r.x0, r[3] = c.y1 - p->r.y0;
+		pos = drawd(pos, p->backing, top->image, r, top->x0 + c.x0, top->y0 + c.y0);
+		pos = drawd(pos, top->image, p->image, (int[]){top->x0 + c.x0, top->y0 + c.y0, top->x0 + c.x1, top->y0 + c.y1}, r[0], r[1]);
+	}
+	return pos;
+}
+
+static void
+damageadd(struct damage *d, int x0, int y0, int x1, int y1)
+{
+	/* nothing is drawn left of or above the origin, and x0 -1 means none */
+	if (x0 < 0)
+		x0 = 0;
+	if (y0 < 0)
+		y0 = 0;
+	if (x0 >= x1 || y0 >= y1)
+		return;
+	/* TODO: better damage tracking */
+	if (d->x0 == -1 || x0 < d->x0)
+		d->x0 = x0;
+	if (d->y0 == -1 || y0 < d->y0)
+		d->y0 = y0;
+	if (d->x1 == -1 || x1 > d->x1)
+		d->x1 = x1;
+	if (d->y1 == -1 || y1 > d->y1)
+		d->y1 = y1;
+}
+
+/* clip d to x1, y1; returns 0 if nothing is left */
+static int
+damageclip(struct damage *d, int x1, int y1)
+{
+	if (d->x0 == -1)
+		return 0;
+	if (d->x0 < 0)
+		d->x0 = 0;
+	if (d->y0 < 0)
+		d->y0 = 0;
+	if (d->x1 > x1)
+		d->x1 = x1;
+	if (d->y1 > y1)
+		d->y1 = y1;
+	return d->x0 < d->x1 && d->y0 < d->y1;
+}
+
+/* whether the buffer of s is cropped or scaled, by a viewport or buffer scale */
+static int
+surfacescaled(struct surface *s)
+{
+	return s->state.srcw != -1 || s->state.dstw != -1 || s->state.scale != 1;
+}
+
+/* the size of s, from its buffer, scale and viewport; 0 without a buffer */
+static int
+surfacesize(struct surface *s, int *width, int *height)
+{
+	struct wl_shm_buffer *b;
+
+	b = wl_shm_buffer_get(s->state.buffer);
+	if (!b) {
+		*width = *height = 0;
+		return 0;
+	}
+	if (s->state.dstw != -1) {
+		*width = s->state.dstw;
+		*height = s->state.dsth;
+	} else if (s->state.srcw != -1) {
+		*width = wl_fixed_to_int(s->state.srcw);
+		*height = wl_fixed_to_int(s->state.srch);
+	} else {
+		*width = wl_shm_buffer_get_width(b) / s->state.scale;
+		*height = wl_shm_buffer_get_height(b) / s->state.scale;
+	}
+	return 1;
+}
+
+/*
+ * Map the buffer of s onto its surface of width x height. Where
+ * that replicates whole source pixels, nearest neighbour gives the
+ * same result as the exact scale, and is used instead of bilinear.
+ */
+static void
+surfacescaler(struct surface *s, struct wl_shm_buffer *b, int width, int height, struct scaler *sc)
+{
+	int64_t x, y, w, h;
+
+	if (s->state.srcw != -1) {
+		x = (int64_t)s->state.srcx * s->state.scale << 8;
+		y = (int64_t)s->state.srcy * s->state.scale << 8;
+		w = (int64_t)s->state.srcw * s->state.scale << 8;
+		h = (int64_t)s->state.srch * s->state.scale << 8;
+	} else {
+		x = y = 0;
+		w = (int64_t)wl_shm_buffer_get_width(b) << 16;
+		h = (int64_t)wl_shm_buffer_get_height(b) << 16;
+	}
+	sc->data = wl_shm_buffer_get_data(b);
+	sc->stride = wl_shm_buffer_get_stride(b);
+	sc->x0 = x >> 16;
+	sc->y0 = y >> 16;
+	sc->x1 = x + w + 0xffff >> 16;
+	sc->y1 = y + h + 0xffff >> 16;
+	sc->dx = w / width;
+	sc->dy = h / height;
+	/* pixel centres, less half a pixel so that bilinear weights are from the left */
+	sc->sx = x + sc->dx / 2 - 0x8000;
+	sc->sy = y + sc->dy / 2 - 0x8000;
+	sc->nearest = ((x | y | w | h) & 0xffff) == 0
+		&& width % (w >> 16) == 0 && height % (h >> 16) == 0;
+}
+
+/* the factors by which the buffer of s replicates pixels, if it does */
+static int
+surfacerepl(struct surface *s, struct wl_shm_buffer *b, struct scaler *sc, int *kx, int *ky)
+{
+	int width, height;
+
+	if (recording() || !surfacescaled(s) || !surfacesize(s, &width, &height) || width <= 0 || height <= 0)
+		return 0;
+	surfacescaler(s, b, width, height, sc);
+	if (!sc->nearest)
+		return 0;
+	*kx = width / (sc->x1 - sc->x0);
+	*ky = height / (sc->y1 - sc->y0);
+	return *kx > 1 || *ky > 1;
+}
+
+/* whether the subsurface or any of its ancestors is synchronized */
+static int
+subsurfacesync(struct subsurface *sub)
+{
+	for (; sub; sub = sub->parent ? sub->parent->sub : NULL) {
+		if (sub->sync)
+			return 1;
+	}
+	return 0;
+}
+
+/* update the size of the subsurface s from its state */
+static void
+subsurfaceresize(struct surface *s)
+{
+	struct subsurface *sub;
+	int width, height;
+
+	sub = s->sub;
+	surfacesize(s, &width, &height);
+	if (width != sub->w || height != sub->h) {
+		damageadd(&s->state.damage, 0, 0, width > sub->w ? width : sub->w, height > sub->h ? height : sub->h);
+		sub->w = width;
+		sub->h = height;
+	}
+}
+
+static void cacheapply(struct surface *);
+
+/* apply the pending positions and cached state of the subsurfaces of s */
+static void
+subsurfaceapply(struct surface *s)
+{
+	struct subsurface *sub;
+
+	wl_list_for_each(sub, &s->subsurfaces, link) {
+		if (sub->x != sub->nextx || sub->y != sub->nexty) {
+			damageadd(&s->state.damage, sub->x, sub->y, sub->x + sub->w, sub->y + sub->h);
+			sub->x = sub->nextx;
+			sub->y = sub->nexty;
+			damageadd(&s->state.damage, sub->x, sub->y, sub->x + sub->w, sub->y + sub->h);
+		}
+		if (sub->surface->cached)
+			cacheapply(sub->surface);
+	}
+}
+
+/* move the committed damage of the subsurfaces of s, at x, y, into d */
+static void
+treedamage(struct surface *s, int x, int y, struct damage *d)
+{
+	struct subsurface *sub;
+	struct damage *c;
+	int sx, sy;
+
+	wl_list_for_each(sub, &s->subsurfaces, link) {
+		sx = x + sub->x;
+		sy = y + sub->y;
+		c = &sub->surface->state.damage;
+		if (c->x0 != -1) {
+			damageadd(d, sx + c->x0, sy + c->y0, sx + c->x1, sy + c->y1);
+			*c = nodamage;
+		}
+		treedamage(sub->surface, sx, sy, d);
+	}
+}
+
+/* replace *row with one of n pixels */
+static int
+rowgrow(uint32_t **row, size_t *len, size_t n)
+{
+	free(*row);
+	*row = malloc(n * sizeof **row);
+	if (!*row) {
+		*len = 0;
+		perror(NULL);
+		return -1;
+	}
+	*len = n;
+	return 0;
+}
+
+/*
+ * Composite the part of the surface tree of s, at x, y, within d
+ * into the window's stage. Surfaces that are opaque, by format or
+ * opaque region, are copied rather than blended. Those with a
+ * viewport or buffer scale are scaled a row at a time, into the
+ * stage if opaque: a buffer scale alone is reduced with a box
+ * filter, and anything else bilinearly.
+ */
+static void
+composite(struct window *w, struct surface *s, int x, int y, const struct damage *d)
+{
+	static uint32_t *row;
+	static size_t rowlen;
+	struct wl_shm_buffer *b;
+	struct subsurface *sub;
+	struct scaler sc;
+	unsigned char *src;
+	uint32_t *dst, fmt;
+	size_t stride;
+	int width, height, x0, y0, x1, y1, k, opaque;
+
+	b = wl_shm_buffer_get(s->state.buffer);
+	if (surfacesize(s, &width, &height)) {
+		x0 = x > d->x0 ? x : d->x0;
+		y0 = y > d->y0 ? y : d->y0;
+		x1 = x + width < d->x1 ? x + width : d->x1;
+		y1 = y + height < d->y1 ? y + height : d->y1;
+		if (x0 < x1 && y0 < y1) {
+			fmt = wl_shm_buffer_get_format(b);
+			opaque = fmt == WL_SHM_FORMAT_XRGB8888
+				|| s->state.opaque.x0 != -1
+				&& s->state.opaque.x0 <= 0 && s->state.opaque.y0 <= 0
+				&& s->state.opaque.x1 >= width && s->state.opaque.y1 >= height;
+			dst = w->stage + (size_t)y0 * w->stagew + x0;
+			stride = wl_shm_buffer_get_stride(b);
+			src = wl_shm_buffer_get_data(b);
+			if (!surfacescaled(s)) {
+				src += (y0 - y) * stride + (x0 - x) * 4;
+				for (; y0 < y1; ++y0, src += stride, dst += w->stagew) {
+					if (opaque)
+						memcpy(dst, src, (x1 - x0) * 4);
+					else
+						blend(dst, (uint32_t *)src, x1 - x0);
+				}
+			} else if (opaque || rowlen >= x1 - x0 || rowgrow(&row, &rowlen, x1 - x0) == 0) {
+				k = s->state.scale;
+				if (s->state.srcw == -1 && s->state.dstw == -1 && k <= BOXMAX) {
+					src += (y0 - y) * k * stride + (x0 - x) * k * 4;
+					for (; y0 < y1; ++y0, src += k * stride, dst += w->stagew) {
+						boxrow(opaque ? dst : row, src, stride, x1 - x0, k);
+						if (!opaque)
+							blend(dst, row, x1 - x0);
+					}
+				} else {
+					surfacescaler(s, b, width, height, &sc);
+					for (; y0 < y1; ++y0, dst += w->stagew) {
+						scalerow(&sc, opaque ? dst : row, x0 - x, x1 - x, y0 - y);
+						if (!opaque)
+							blend(dst, row, x1 - x0);
+					}
+				}
+			}
+		}
+	}
+	wl_list_for_each(sub, &s->subsurfaces, link)
+		composite(w, sub->surface, x + sub->x, y + sub->y, d);
+}
+
+/*
+ * Composite the surface tree of w within d into its stage, which
+ * is fully damaged when it is resized.
+ */
+static int
+winstage(struct window *w, int width, int height, struct damage *d)
+{
+	uint32_t *row;
+	int y;
+
+	if (width <= 0 || height <= 0)
+		return -1;
+	if (!w->stage || w->stagew != width || w->stageh != height) {
+		free(w->stage);
+		w->stage = malloc((size_t)width * height * 4);
+		if (!w->stage) {
+			perror(NULL);
+			return -1;
+		}
+		w->stagew = width;
+		w->stageh = height;
+		d->x0 = 0, d->y0 = 0;
+		d->x1 = width, d->y1 = height;
+	}
+	if (damageclip(d, width, height)) {
+		row = w->stage + (size_t)d->y0 * width + d->x0;
+		for (y = d->y0; y < d->y1; ++y, row += width)
+			memset(row, 0, (d->x1 - d->x0) * 4);
+		composite(w, w->surface, 0, 0, d);
+	}
+	return 0;
+}
+
+/*
+ * Upload the damaged part of a window. Without subsurfaces or a
+ * viewport, this is copied straight from the client's buffer, and
+ * a viewport that replicates whole pixels is scaled by the server.
+ * Otherwise, the surface tree is first composited into the window's
+ * stage. While an earlier upload is unacknowledged, damage is left
+ * to accumulate until it completes.
+ */
+static void
+windraw(struct window *w)
+{
+	struct surface *s;
+	struct wl_shm_buffer *b;
+	struct drawcopy d;
+	struct scaler sc;
+	unsigned char *pos;
+	int width, height, sw, sh, kx, ky, repl;
+
+	if (w->upload) {
+		w->redraw = 1;
+		return;
+	}
+	s = w->surface;
+	width = w->x1 - w->x0;
+	height = w->y1 - w->y0;
+	treedamage(s, 0, 0, &s->state.damage);
+	d.w = w;
+	d.d = s->state.damage;
+	b = wl_shm_buffer_get(s->state.buffer);
+	repl = wl_list_empty(&s->subsurfaces) && b && surfacerepl(s, b, &sc, &kx, &ky);
+	if (repl) {
+		free(w->stage);
+		w->stage = NULL;
+		surfacesize(s, &sw, &sh);
+		if (width > sw)
+			width = sw;
+		if (height > sh)
+			height = sh;
+	} else if (wl_list_empty(&s->subsurfaces) && !surfacescaled(s)) {
+		free(w->stage);
+		w->stage = NULL;
+		b = wl_shm_buffer_get(s->state.buffer);
+		if (!b)
+			goto nodraw;
+		if (width > wl_shm_buffer_get_width(b))
+			width = wl_shm_buffer_get_width(b);
+		if (height > wl_shm_buffer_get_height(b))
+			height = wl_shm_buffer_get_height(b);
+		d.img = wl_shm_buffer_get_data(b);
+		d.stride = wl_shm_buffer_get_stride(b);
+	} else {
+		if (winstage(w, width, height, &d.d) != 0)
+			goto nodraw;
+		d.img = (unsigned char *)w->stage;
+		d.stride = (size_t)width * 4;
+	}
+	if (!damageclip(&d.d, width, height))
+		goto nodraw;
+	d.image = w->image;
+	d.ox = w->x0;
+	d.oy = w->y0;
+	if (repl) {
+		d.flush = 0;
+		pos = drawrepl(&d, &sc, kx, ky);
+	} else {
+		reccommit(w->image, width, height, (int[]){d.d.x0, d.d.y0, d.d.x1, d.d.y1}, d.img, d.stride);
+		d.flush = wl_list_empty(&w->popups);
+		drawcopyinit(&d);
+		drawcopy(&d);
+		pos = draw.buf;
+	}
+	s->state.damage = nodamage;
+	if (!d.flush && d.tag != -1) {
+		pos = popupsdraw(pos, w, w->popups.next, &d.d);
+		*pos++ = 'v';
+		drawflush(pos, w);
+	} else {
+		drawwait(w, d.tag);
+	}
+	return;
+
+nodraw:
+	/* the commit changed nothing on screen, so it ends the measurement */
+	if (w->committime) {
+		w->inputtime = 0;
+		w->committime = 0;
+	}
+}
 
 static void
-drawcopy(struct drawcopy *d)
+snarfdone(struct snarfput *put)
 {
-	int x, y, x0, y0, x1, y1;
-	unsigned char *img, *buf, *pos;
-	size_t n, stride;
-	int done;
 	C9tag tag;
-	struct wl_resource *r, *tmp;
 
-	x = d->x, y = d->y;
-	stride = wl_shm_buffer_get_stride(d->b);
-	img = wl_shm_buffer_get_data(d->b);
-	img += x * 4 + y * stride;
-	buf = draw.buf;
-	*buf++ = 'y';
-	buf = putle32(buf, d->w->image);
-	tag = -1;
-	for (done = 0; !done;) {
-		x0 = x;
-		x1 = x + d->dx;
-		if (x1 > d->d.x1)
-			x1 = d->d.x1;
+	if (put->snarf >= 0)
+		fsclunk(&termctx, &tag, put->snarf);
+	if (put->source) {
+		wl_list_remove(&put->source_destroy.link);
+		wl_data_source_send_cancelled(put->source);
+	}
+	free(put);
+}
 
-		y0 = y;
-		y1 = y + d->dy;
-		if (y1 > d->d.y1)
-			y1 = d->d.y1;
+static void
+snarfput_source_destroyed(struct wl_listener *listener, void *data)
+{
+	struct snarfput *put;
 
-		pos = putle32(buf, d->w->x0 + x0);
-		pos = putle32(pos, d->w->y0 + y0);
-		pos = putle32(pos, d->w->x0 + x1);
-		pos = putle32(pos, d->w->y0 + y1);
-		n = (x1 - x0) * 4;
-		for (; y < y1; ++y)
-			memcpy(pos, img, n), pos += n, img += stride;
-		if (x1 < d->d.x1)
-			x = x1, --y;
-		else
-			x = d->d.x0;
-		if (y == d->d.y1) {
-			done = 1;
-			*pos++ = 'v';
-		}
+	put = wl_container_of(listener, put, source_destroy);
+	put->source = NULL;
+}
 
-		if (fswrite(&termctx, &tag, draw.datafid, 0, draw.buf, pos - draw.buf) != 0) {
-			fprintf(stderr, "fswrite %s draw: %s\n", d->w->name, termaux.err);
-			break;
-		}
-	}
-	assert(tag != -1);
-	free(fswait(&termctx, tag, Rwrite));
+static void
+snarfwritten(C9r *reply, void *aux)
+{
+	struct snarfput *put;
 
-	d->x = x;
-	d->y = y;
-	d->w->surface->pending.damage.x0 = -1;
-	d->w->surface->pending.damage.y0 = -1;
-	d->w->surface->pending.damage.x1 = -1;
-	d->w->surface->pending.damage.y1 = -1;
-	wl_resource_for_each_safe(r, tmp, &d->w->surface->state.callbacks) {
-		wl_callback_send_done(r, 0);
-		wl_resource_destroy(r);
-	}
+	put = aux;
+	if (reply->type == Rerror)
+		fprintf(stderr, "write /dev/snarf: %s\n", reply->error);
+	if (--put->writes == 0 && !put->event)
+		snarfdone(put);
+	else if (put->event && put->writes == SNARFWRITES - 1)
+		wl_event_source_fd_update(put->event, WL_EVENT_READABLE);
 }
 
+/*
+ * Copy the selection to /dev/snarf with up to SNARFWRITES writes in
+ * flight, pausing the pipe while the window is full.
+ */
 static int
 snarfput(int fd, uint32_t mask, void *data)
 {
 	struct snarfput *put;
-	char buf[8192];
-	size_t len;
 	ssize_t ret;
+	C9tag tag;
 
 	put = data;
-	len = sizeof buf;
-	if (termctx.msize < len)
-		len = termctx.msize - IOHDRSZ;
-	ret = read(fd, buf, len);
+	ret = read(fd, put->buf, put->buflen);
+	if (ret > 0 && fswrite(&termctx, &tag, put->snarf, put->offset, put->buf, ret) != 0) {
+		fprintf(stderr, "write /dev/snarf: %s\n", termaux.err);
+		ret = 0;
+	}
 	if (ret <= 0) {
 		if (ret < 0)
 			perror("read wl_data_source");
-		close(fd);
-		fsclunk(&termctx, put->snarf);
+		close(put->fd);
 		wl_event_source_remove(put->event);
-		wl_data_source_send_cancelled(put->source);
-		free(put);
+		put->event = NULL;
+		if (put->writes == 0)
+			snarfdone(put);
 		return 0;
 	}
-	fswrite(&termctx, NULL, put->snarf, put->offset, buf, ret);
+	fsasync(&termctx, tag, snarfwritten, put);
 	put->offset += ret;
+	if (++put->writes == SNARFWRITES)
+		wl_event_source_fd_update(put->event, 0);
 	return 0;
 }
 
-static void
-snarfget(C9r *reply, void *aux)
+static int
+snarfsend(int fd, uint32_t mask, void *data)
 {
-	struct snarfget *get;
-	C9tag tag;
-	unsigned char *pos, *end;
+	struct snarfsend *send;
 	ssize_t ret;
 
-	get = aux;
-	if (reply->type == Rerror) {
-		fprintf(stderr, "read snarf: %s\n", reply->error);
-		goto free;
-	}
-	if (reply->read.size == 0) {
-		goto free;
-	}
-	get->offset += reply->read.size;
-	pos = reply->read.data;
-	end = pos + reply->read.size;
-	while (pos < end) {
-		ret = write(get->fd, pos, end - pos);
+	send = data;
+	while (send->off < send->len) {
+		ret = write(fd, send->data + send->off, send->len - send->off);
 		if (ret < 0) {
+			if (errno == EAGAIN)
+				return 0;
 			perror("write wl_data_offer");
-			goto free;
+			break;
 		}
-		pos += ret;
+		send->off += ret;
+	}
+	wl_event_source_remove(send->event);
+	close(fd);
+	free(send);
+	return 0;
+}
+
+/*
+ * Write a copy of the selection to the client's pipe as it drains,
+ * so a client that reads it only later does not block wl9.
+ */
+static void
+snarfdeliver(int fd, const char *data, size_t len)
+{
+	struct snarfsend *send;
+	int flags;
+
+	send = malloc(sizeof *send + len);
+	if (!send) {
+		perror(NULL);
+		goto error;
+	}
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+		perror("fcntl");
+		goto error;
 	}
-	if (fsread(&termctx, &tag, NULL, term.snarf, get->offset, 1024) != 0)
-		goto free;
-	fsasync(&termctx, tag, snarfget, get);
+	send->event = wl_event_loop_add_fd(evt, fd, WL_EVENT_WRITABLE, snarfsend, send);
+	if (!send->event) {
+		fprintf(stderr, "failed to add wl_data_offer event source\n");
+		goto error;
+	}
+	send->off = 0;
+	send->len = len;
+	memcpy(send->data, data, len);
 	return;
 
-free:
-	close(get->fd);
+error:
+	free(send);
+	close(fd);
+}
+
+static void snarfgot(C9r *reply, void *aux);
+
+static int
+snarfread(struct snarfread *rd)
+{
+	struct snarfget *get;
+	C9tag tag;
+
+	get = rd->get;
+	rd->off = get->next;
+	if (fsread(&termctx, &tag, NULL, term.snarf, rd->off, get->readsz) != 0) {
+		fprintf(stderr, "read /dev/snarf: %s\n", termaux.err);
+		return -1;
+	}
+	fsasync(&termctx, tag, snarfgot, rd);
+	get->next += get->readsz;
+	++get->reads;
+	return 0;
+}
+
+/*
+ * Read /dev/snarf with up to SNARFREADS msize reads in flight. The
+ * replies may arrive in any order, so each lands at its own offset,
+ * and the first short read marks the end.
+ */
+static void
+snarfgot(C9r *reply, void *aux)
+{
+	struct snarfread *rd;
+	struct snarfget *get;
+	size_t end, cap;
+	char *data;
+
+	rd = aux;
+	get = rd->get;
+	--get->reads;
+	if (reply->type == Rerror) {
+		fprintf(stderr, "read /dev/snarf: %s\n", reply->error);
+		get->err = 1;
+	} else if (!get->err) {
+		end = rd->off + reply->read.size;
+		if (end > get->cap) {
+			cap = get->cap ? get->cap : get->readsz * SNARFREADS;
+			while (cap < end)
+				cap *= 2;
+			data = realloc(get->data, cap);
+			if (!data) {
+				perror(NULL);
+				get->err = 1;
+				goto done;
+			}
+			get->data = data;
+			get->cap = cap;
+		}
+		memcpy(get->data + rd->off, reply->read.data, reply->read.size);
+		if (reply->read.size < get->readsz) {
+			if (end < get->len)
+				get->len = end;
+		} else if (get->next < get->len && snarfread(rd) != 0) {
+			get->err = 1;
+		}
+	}
+done:
+	if (get->reads > 0)
+		return;
+	if (get->err) {
+		close(get->fd);
+		free(get->data);
+	} else {
+		snarfdeliver(get->fd, get->data, get->len);
+		free(snarfcache.data);
+		snarfcache.data = get->data;
+		snarfcache.len = get->len;
+		snarfcache.vers = get->vers;
+		/* a server that does not version the file cannot be validated */
+		snarfcache.valid = get->stat && get->vers;
+	}
 	free(get);
 }
 
+static void
+snarfstat(C9r *reply, void *aux)
+{
+	struct snarfget *get;
+	C9stat *st;
+	int i;
+
+	get = aux;
+	if (reply->type == Rerror) {
+		fprintf(stderr, "stat /dev/snarf: %s\n", reply->error);
+	} else {
+		st = &reply->stat;
+		if (snarfcache.valid && st->qid.version == snarfcache.vers) {
+			snarfdeliver(get->fd, snarfcache.data, snarfcache.len);
+			free(get);
+			return;
+		}
+		get->stat = 1;
+		get->vers = st->qid.version;
+	}
+	for (i = 0; i < SNARFREADS; ++i) {
+		get->rd[i].get = get;
+		if (snarfread(&get->rd[i]) != 0) {
+			get->err = 1;
+			break;
+		}
+	}
+	if (get->reads == 0) {
+		close(get->fd);
+		free(get);
+	}
+}
+
 static void
 snarfoffer(struct window *w)
 {
@@ -322,10 +1460,14 @@ mousefocus(struct window *w, int x, int y)
 	uint32_t serial;
 
 	serial = wl_display_next_serial(dpy);
+	mouse.motion = 0;
 	if (mouse.focus) {
 		s = mouse.focus->surface->resource;
-		wl_resource_for_each(r, &mouse.active)
+		wl_resource_for_each(r, &mouse.active) {
 			wl_pointer_send_leave(r, serial, s);
+			if (wl_resource_get_version(r) >= 5)
+				wl_pointer_send_frame(r);
+		}
 		wl_list_insert_list(&mouse.inactive, &mouse.active);
 		wl_list_init(&mouse.active);
 	}
@@ -338,6 +1480,8 @@ mousefocus(struct window *w, int x, int y)
 			wl_list_remove(wl_resource_get_link(r));
 			wl_list_insert(&mouse.active, wl_resource_get_link(r));
 			wl_pointer_send_enter(r, serial, s, x << 8, y << 8);
+			if (wl_resource_get_version(r) >= 5)
+				wl_pointer_send_frame(r);
 		}
 	}
 	mouse.focus = w;
@@ -375,17 +1519,17 @@ kbdfocus(struct window *w)
 	kbd.focus = w;
 }
 
+static void wctlread(C9r *, void *);
+
 static void
-wctlread(C9r *reply, void *data)
+wctlupdate(C9r *reply, struct window *w)
 {
 	static struct wl_array states;
-	struct window *w;
 	char *pos, *current, *hidden, buf[sizeof w->name + 6];
 	int x0, y0, x1, y1, needconfig;
 	size_t namelen;
 	C9r *r;
 
-	w = data;
 	w->wctltag = -1;
 	if (reply->type == Rerror) {
 		xdg_toplevel_send_close(w->toplevel);
@@ -434,33 +1578,13 @@ wctlread(C9r *reply, void *data)
 		*pos++ = namelen;
 		memcpy(pos, w->name, namelen), pos += namelen;
 		assert(pos - buf < sizeof buf);
-		if (fswrite(&termctx, NULL, draw.datafid, 0, buf, pos - buf) != 0) {
-			fprintf(stderr, "fswrite %s draw: %s\n", w->name, termaux.err);
+		if (fswrite(draw.ctx, NULL, draw.datafid, 0, buf, pos - buf) != 0) {
+			fprintf(stderr, "fswrite %s draw: %s\n", w->name, draw.ctx->aux->err);
 			return;
 		}
 		if (!needconfig) {
-			struct drawcopy d;
-			size_t n;
-
-			d.w = w;
-			d.b = wl_shm_buffer_get(w->surface->pending.buffer);
-			if (!d.b)
-				return;
-			d.d.x0 = 0;
-			d.d.y0 = 0;
-			d.d.x1 = x1 - x0;
-			d.d.y1 = y1 - y0;
-			d.x = d.d.x0;
-			d.y = d.d.y0;
-			d.dx = d.d.x1 - d.d.x0;
-			n = draw.buflen - 22;
-			if (n < 4 * d.dx) {
-				d.dx = (4 * d.dx + n - 1) / n;
-				d.dy = 1;
-			} else {
-				d.dy = n / (4 * d.dx);
-			}
-			drawcopy(&d);
+			damageadd(&w->surface->state.damage, 0, 0, x1 - x0, y1 - y0);
+			windraw(w);
 		}
 	}
 	if (w->current != (strcmp(current, "current") == 0)) {
@@ -490,6 +1614,14 @@ wctlread(C9r *reply, void *data)
 	}
 }
 
+static void
+wctlread(C9r *reply, void *data)
+{
+	TRACEBEGIN(span);
+	wctlupdate(reply, data);
+	TRACEEND(span, "wctlread");
+}
+
 static void
 mouseaxis(struct wl_resource *r, uint32_t time, int val)
 {
@@ -504,34 +1636,108 @@ mouseaxis(struct wl_resource *r, uint32_t time, int val)
 	wl_pointer_send_axis(r, time, axis, 15 * val << 8);
 }
 
+/* note input received at time t that the client may respond to */
 static void
-mouseread(C9r *reply, void *data)
+inputmark(struct window *w, uint64_t t)
+{
+	if (!w->inputtime)
+		w->inputtime = t;
+}
+
+/* send pending coalesced motion to the focused window */
+static void
+mousemotion(int frame)
 {
-	static const int button[] = {0x110, 0x112, 0x111};
 	struct window *w;
+	struct wl_resource *r;
+
+	w = mouse.focus;
+	if (!mouse.motion || !w)
+		return;
+	mouse.motion = 0;
+	wl_resource_for_each(r, &mouse.active) {
+		wl_pointer_send_motion(r, mouse.time, w->mousex << 8, w->mousey << 8);
+		if (frame && wl_resource_get_version(r) >= 5)
+			wl_pointer_send_frame(r);
+	}
+}
+
+static int
+mousetimer(void *data)
+{
+	mousemotion(1);
+	return 0;
+}
+
+/* called after each dispatch batch */
+static void
+mouseflush(void)
+{
+	uint64_t elapsed;
+
+	if (!mouse.motion)
+		return;
+	if (mouse.delay > 0) {
+		elapsed = (nsec() - mouse.since) / 1000000;
+		if (elapsed < mouse.delay) {
+			wl_event_source_timer_update(mouse.timer, mouse.delay - elapsed);
+			return;
+		}
+	}
+	mousemotion(1);
+}
+
+static void popuphide(struct popup *);
+
+/* the topmost popup of w at x, y, which are made relative to it */
+static struct window *
+popupat(struct window *w, unsigned long *x, unsigned long *y)
+{
+	struct popup *p;
+	long px, py;
+
+	px = (long)*x, py = (long)*y;
+	wl_list_for_each_reverse(p, &w->popups, link) {
+		if (px >= p->r.x0 && px < p->r.x1 && py >= p->r.y0 && py < p->r.y1) {
+			*x = px - p->r.x0;
+			*y = py - p->r.y0;
+			return p->w;
+		}
+	}
+	return w;
+}
+
+/* a click outside the popups of w dismisses those with a grab */
+static void
+popupsdismiss(struct window *w)
+{
+	struct popup *p, *tmp;
+
+	wl_list_for_each_safe(p, tmp, &w->popups, link) {
+		if (p->grab) {
+			xdg_popup_send_popup_done(p->resource);
+			popuphide(p);
+		}
+	}
+}
+
+static void
+mouseevent(struct window *w, unsigned char *data, uint32_t size, uint64_t time)
+{
+	static const int button[] = {0x110, 0x112, 0x111};
 	char *pos;
 	unsigned long x, y, b, t;
 	struct wl_resource *r;
+	struct window *target;
 	uint32_t serial, state;
 	unsigned long pressed, changed;
 	int i;
 
-	w = data;
-	w->mousetag = -1;
-	if (reply->type == Rerror) {
-		fprintf(stderr, "fsread %s mouse: %s\n", w->name, reply->error);
-		return;
-	}
-	if (fsread(&termctx, &w->mousetag, NULL, w->mouse, 0, 49) != 0) {
-		fprintf(stderr, "fsread %s mouse: %s\n", w->name, termaux.err);
-		return;
-	}
-	fsasync(&termctx, w->mousetag, mouseread, w);
-	if (reply->read.size != 49) {
-		fprintf(stderr, "unexpected mouse data: size %"PRIu32" %.*s", reply->read.size, (int)reply->read.size, reply->read.data);
+	if (size != 49) {
+		fprintf(stderr, "unexpected mouse data: size %"PRIu32" %.*s", size, (int)size, data);
 		return;
 	}
-	pos = (char *)reply->read.data;
+	pos = (char *)data;
 	pos[48] = 0;
 	if (*pos != 'm')
 		return;
@@ -540,14 +1746,25 @@ mouseread(C9r *reply, void *data)
 	y = strtoul(pos, &pos, 10) - w->y0;
 	b = strtoul(pos, &pos, 10);
 	t = strtoul(pos, &pos, 10);
-	if (mouse.focus != w) {
-		mousefocus(w, x, y);
-	} else if (x != w->mousex || y != w->mousey) {
-		wl_resource_for_each(r, &mouse.active)
-			wl_pointer_send_motion(r, t, x << 8, y << 8);
+	inputmark(w, time);
+	target = popupat(w, &x, &y);
+	if (mouse.focus != target) {
+		mousefocus(target, x, y);
+	} else if (x != target->mousex || y != target->mousey) {
+		if (!mouse.motion)
+			mouse.since = nsec();
+		mouse.motion = 1;
+		mouse.time = t;
 	}
+	target->mousex = x;
+	target->mousey = y;
+	if (b == w->button)
+		return;
+	mousemotion(0);
 	pressed = b & ~w->button;
 	changed = b ^ w->button;
+	if (pressed && target == w)
+		popupsdismiss(w);
 	wl_resource_for_each(r, &mouse.active) {
 		for (i = 0; i < 3; i++) {
 			if (~changed & 1ul << i)
@@ -565,18 +1782,15 @@ mouseread(C9r *reply, void *data)
 		if (wl_resource_get_version(r) >= 5)
 			wl_pointer_send_frame(r);
 	}
-	w->mousex = x;
-	w->mousey = y;
 	w->button = b;
 }
 
 static unsigned char *
-kbdevent(struct window *w, unsigned char *pos, unsigned char *end)
+kbdevent(struct window *w, unsigned char *pos, unsigned char *end, uint64_t t)
 {
 	static struct wl_array keys;
 	struct wl_resource *r;
 	uint32_t *key, *oldkey, state, mods, serial, time, eventkey;
-	struct timespec ts;
 	size_t n, notfound;
 	int needenter;
 
@@ -590,6 +1804,7 @@ kbdevent(struct window *w, unsigned char *pos, unsigned char *end)
 	case 'K': state = WL_KEYBOARD_KEY_STATE_RELEASED; break;
 	default: return end + 1;
 	}
+	inputmark(w, t);
 	keys.size = 0;
 	for (++pos; pos < end; pos += n) {
 		key = wl_array_add(&keys, sizeof *key);
@@ -636,10 +1851,7 @@ kbdevent(struct window *w, unsigned char *pos, unsigned char *end)
 		needenter = notfound != (state == WL_KEYBOARD_KEY_STATE_RELEASED);
 	}
 	serial = wl_display_next_serial(dpy);
-	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
-		time = ts.tv_sec * 1000ul + ts.tv_sec / 1000000ul;
-	else
-		time = 0;
+	time = nsec() / 1000000;
 	if (needenter) {
 		wl_resource_for_each(r, &kbd.active) {
 			wl_keyboard_send_enter(r, serial, w->surface->resource, &keys);
@@ -667,26 +1879,87 @@ kbdevent(struct window *w, unsigned char *pos, unsigned char *end)
 }
 
 static void
-kbdread(C9r *reply, void *data)
+kbdevents(struct window *w, unsigned char *data, uint32_t size, uint64_t time)
 {
-	struct window *w;
 	unsigned char *pos, *end;
 
-	w = data;
-	w->kbdtag = -1;
+	pos = data;
+	end = pos + size;
+	while (pos && pos < end)
+		pos = kbdevent(w, pos, end, time);
+}
+
+static void inputread(C9r *, void *);
+
+/* issue reads until readdepth are outstanding */
+static int
+inputfill(struct input *in)
+{
+	struct inputread *rd;
+
+	while (!in->error && in->count < readdepth) {
+		rd = &in->read[(in->head + in->count) % MAXREADS];
+		if (fsread(&termctx, &rd->tag, NULL, in->fid, 0, in->size) != 0) {
+			fprintf(stderr, "fsread %s: %s\n", in->w->name, termaux.err);
+			return -1;
+		}
+		fsasync(&termctx, rd->tag, inputread, rd);
+		rd->in = in;
+		rd->done = 0;
+		++in->count;
+	}
+	return 0;
+}
+
+static void
+inputread(C9r *reply, void *data)
+{
+	struct inputread *rd;
+	struct input *in;
+
+	TRACEBEGIN(span);
+	rd = data;
+	in = rd->in;
+	rd->done = 1;
+	rd->size = 0;
 	if (reply->type == Rerror) {
-		fprintf(stderr, "fsread %s kbd: %s\n", w->name, reply->error);
-		return;
+		fprintf(stderr, "fsread %s: %s\n", in->w->name, reply->error);
+		in->error = 1;
+	} else {
+		rd->time = fstime(reply);
+		rd->size = reply->read.size;
+		if (rd->size > sizeof rd->data)
+			rd->size = sizeof rd->data;
+		memcpy(rd->data, reply->read.data, rd->size);
 	}
-	if (fsread(&termctx, &w->kbdtag, NULL, w->kbd, 0, 256) != 0) {
-		fprintf(stderr, "fsread %s kbd: %s\n", w->name, reply->error);
-		return;
+	/* deliver completed reads in issue order */
+	while (in->count > 0) {
+		rd = &in->read[in->head];
+		if (!rd->done)
+			break;
+		in->head = (in->head + 1) % MAXREADS;
+		--in->count;
+		if (rd->size > 0)
+			in->event(in->w, rd->data, rd->size, rd->time);
 	}
-	fsasync(&termctx, w->kbdtag, kbdread, w);
-	pos = reply->read.data;
-	end = pos + reply->read.size;
-	while (pos && pos < end)
-		pos = kbdevent(w, pos, end);
+	inputfill(in);
+	TRACEEND(span, in == &in->w->mouse ? "mouse" : "kbd");
+}
+
+static void
+inputstop(struct input *in)
+{
+	struct inputread *rd;
+
+	in->error = 1;
+	while (in->count > 0) {
+		rd = &in->read[in->head];
+		if (!rd->done)
+			fsflush(&termctx, rd->tag);
+		in->head = (in->head + 1) % MAXREADS;
+		--in->count;
+	}
+	fsclunk(&termctx, NULL, in->fid);
 }
 
 static int
@@ -696,16 +1969,16 @@ winnew(struct window *w)
 		const char *name;
 		int *fid;
 		C9mode mode;
-		void (*readcb)(C9r *, void *);
 		int readsz;
 		C9tag tag;
 		int clunk, flush;
 	} *f, files[] = {
-		{"winname", &w->winname, C9read},
-		{"label",   &w->label,   C9write},
-		{"wctl",    &w->wctl,    C9rdwr, NULL,      72},
-		{"mouse",   &w->mouse,   C9read, mouseread, 49},
-		{"kbd",     &w->kbd,     C9read, kbdread,   256},
+		{"winname", &w->winname,   C9read},
+		{"label",   &w->label,     C9write},
+		{"wctl",    &w->wctl,      C9rdwr, 72},
+		{"mouse",   &w->mouse.fid, C9read},
+		{"kbd",     &w->kbd.fid,   C9read},
+		{"cursor",  &w->cursor,    C9write},
 	};
 	char aname[32];
 	C9r *r;
@@ -767,26 +2040,24 @@ winnew(struct window *w)
 			fprintf(stderr, "read %s: %s\n", f->name, termaux.err);
 			goto error;
 		}
-		if (f->readcb)
-			fsasync(&termctx, f->tag, f->readcb, w);
 	}
+	inputfill(&w->mouse);
+	inputfill(&w->kbd);
 	r = fswait(&termctx, files[2].tag, Rread);
 	if (!r)
 		goto error;
 	wctlread(r, w);
-	w->mousetag = files[3].tag;
-	w->kbdtag = files[4].tag;
 	return 0;
 
 error:
-	fsclunk(&termctx, w->wsys);
+	fsclunk(&termctx, NULL, w->wsys);
 	w->wsys = -1;
 	for (f = files; f < files + LEN(files); f++) {
 		numput(&termaux.fid, *f->fid);
 		if (f->flush)
 			fsflush(&termctx, f->tag);
 		if (f->clunk)
-			fsclunk(&termctx, *f->fid);
+			fsclunk(&termctx, NULL, *f->fid);
 		*f->fid = -1;
 	}
 	return -1;
@@ -817,54 +2088,216 @@ static void
 damage(struct wl_client *c, struct wl_resource *r, int32_t x0, int32_t y0, int32_t w, int32_t h)
 {
 	struct surface *s;
-	struct damage *d;
-	int x1, y1;
 
-	x1 = x0 + w;
-	y1 = y0 + h;
 	s = wl_resource_get_user_data(r);
-	d = &s->pending.damage;
-	/* TODO: better damage tracking */
-	if (d->x0 == -1 || x0 < d->x0)
-		d->x0 = x0;
-	if (d->y0 == -1 || y0 < d->y0)
-		d->y0 = y0;
-	if (d->x1 == -1 || x1 > d->x1)
-		d->x1 = x1;
-	if (d->y1 == -1 || y1 > d->y1)
-		d->y1 = y1;
+	damageadd(&s->pending.damage, x0, y0, x0 + w, y0 + h);
+}
+
+static void
+damage_buffer(struct wl_client *c, struct wl_resource *r, int32_t x0, int32_t y0, int32_t w, int32_t h)
+{
+	struct surface *s;
+
+	s = wl_resource_get_user_data(r);
+	damageadd(&s->pending.bufdamage, x0, y0, x0 + w, y0 + h);
+}
+
+static void
+unlink_resource(struct wl_resource *r)
+{
+	wl_list_remove(wl_resource_get_link(r));
+}
+
+static void
+frame(struct wl_client *c, struct wl_resource *r, uint32_t id)
+{
+	struct surface *s;
+	struct wl_resource *cbr;
+
+	s = wl_resource_get_user_data(r);
+	cbr = wl_resource_create(c, &wl_callback_interface, 1, id);
+	if (!cbr) {
+		wl_resource_post_no_memory(r);
+		return;
+	}
+	wl_resource_set_implementation(cbr, NULL, NULL, unlink_resource);
+	wl_list_insert(s->pending.callbacks.prev, wl_resource_get_link(cbr));
+}
+
+static void
+set_opaque_region(struct wl_client *c, struct wl_resource *r, struct wl_resource *reg)
+{
+	struct surface *s;
+	struct region *region;
+
+	s = wl_resource_get_user_data(r);
+	region = reg ? wl_resource_get_user_data(reg) : NULL;
+	s->pending.opaque = region ? region->box : nodamage;
 }
 
 static void
-unlink_resource(struct wl_resource *r)
+set_input_region(struct wl_client *c, struct wl_resource *r, struct wl_resource *reg)
 {
-	wl_list_remove(wl_resource_get_link(r));
 }
 
+/* check the viewport of s against its new buffer and scale */
+static int
+viewportcheck(struct surface *s, struct surface_state *st)
+{
+	struct wl_shm_buffer *b;
+	int k;
+
+	b = wl_shm_buffer_get(st->buffer);
+	if (!b || !s->viewport)
+		return 0;
+	k = st->scale;
+	if (st->srcw != -1
+	 && (((int64_t)st->srcx + st->srcw) * k > (int64_t)wl_shm_buffer_get_width(b) << 8
+	  || ((int64_t)st->srcy + st->srch) * k > (int64_t)wl_shm_buffer_get_height(b) << 8)) {
+		wl_resource_post_error(s->viewport, WP_VIEWPORT_ERROR_OUT_OF_BUFFER, "source rectangle outside buffer");
+		return -1;
+	}
+	if (st->dstw == -1 && st->srcw != -1
+	 && ((st->srcw | st->srch) & 0xff) != 0) {
+		wl_resource_post_error(s->viewport, WP_VIEWPORT_ERROR_BAD_SIZE, "source size is not integer");
+		return -1;
+	}
+	return 0;
+}
+
+/* map damage in buffer coordinates to the surface, rounding outward */
 static void
-frame(struct wl_client *c, struct wl_resource *r, uint32_t id)
+bufdamage(struct surface *s, const struct damage *d)
 {
-	struct surface *s;
-	struct wl_resource *cbr;
+	struct wl_shm_buffer *b;
+	double x, y, sx, sy;
+	int width, height;
 
-	s = wl_resource_get_user_data(r);
-	cbr = wl_resource_create(c, &wl_callback_interface, 1, id);
-	if (!cbr) {
-		wl_resource_post_no_memory(r);
+	b = wl_shm_buffer_get(s->state.buffer);
+	if (!b || !surfacesize(s, &width, &height))
+		return;
+	if (!surfacescaled(s)) {
+		damageadd(&s->state.damage, d->x0, d->y0, d->x1, d->y1);
 		return;
 	}
-	wl_resource_set_implementation(cbr, NULL, NULL, unlink_resource);
-	wl_list_insert(s->pending.callbacks.prev, wl_resource_get_link(cbr));
+	if (s->state.srcw != -1) {
+		x = s->state.srcx * s->state.scale / 256.;
+		y = s->state.srcy * s->state.scale / 256.;
+		sx = width * 256. / s->state.srcw / s->state.scale;
+		sy = height * 256. / s->state.srch / s->state.scale;
+	} else {
+		x = y = 0;
+		sx = (double)width / wl_shm_buffer_get_width(b);
+		sy = (double)height / wl_shm_buffer_get_height(b);
+	}
+	/* filtering spreads each source pixel into its neighbours */
+	damageadd(&s->state.damage, (d->x0 - x) * sx - 1, (d->y0 - y) * sy - 1,
+		(d->x1 - x) * sx + 2, (d->y1 - y) * sy + 2);
+}
+
+/* move the committed state p, pending or cached, into the state of s */
+static int
+stateapply(struct surface *s, struct surface_state *p)
+{
+	int width, height;
+
+	wl_list_insert_list(&s->state.callbacks, &p->callbacks);
+	wl_list_init(&p->callbacks);
+	/* the previous content update was never uploaded */
+	discarded(&s->state.feedback);
+	wl_list_insert_list(&s->state.feedback, &p->feedback);
+	wl_list_init(&p->feedback);
+	if (p->damage.x0 != -1) {
+		damageadd(&s->state.damage, p->damage.x0, p->damage.y0, p->damage.x1, p->damage.y1);
+		p->damage = nodamage;
+	}
+	s->state.opaque = p->opaque;
+	if (s->state.buffer != p->buffer) {
+		if (s->state.buffer) {
+			wl_buffer_send_release(s->state.buffer);
+			wl_list_remove(&s->state.buffer_destroy.link);
+		}
+		if (p->buffer)
+			wl_resource_add_destroy_listener(p->buffer, &s->state.buffer_destroy);
+		s->state.buffer = p->buffer;
+	}
+	if (s->state.srcx != p->srcx || s->state.srcy != p->srcy
+	 || s->state.srcw != p->srcw || s->state.srch != p->srch
+	 || s->state.dstw != p->dstw || s->state.dsth != p->dsth
+	 || s->state.scale != p->scale) {
+		s->state.srcx = p->srcx, s->state.srcy = p->srcy;
+		s->state.srcw = p->srcw, s->state.srch = p->srch;
+		s->state.dstw = p->dstw, s->state.dsth = p->dsth;
+		s->state.scale = p->scale;
+		if (surfacesize(s, &width, &height))
+			damageadd(&s->state.damage, 0, 0, width, height);
+	}
+	if (viewportcheck(s, &s->state) != 0)
+		return -1;
+	if (p->bufdamage.x0 != -1) {
+		bufdamage(s, &p->bufdamage);
+		p->bufdamage = nodamage;
+	}
+	return 0;
 }
 
+/*
+ * Cache the pending state of a synchronized subsurface, merging it
+ * with any earlier commit that its parent has not yet applied.
+ */
 static void
-set_opaque_region(struct wl_client *c, struct wl_resource *r, struct wl_resource *reg)
+statecache(struct surface *s)
 {
+	struct surface_state *p, *c;
+
+	p = &s->pending;
+	c = &s->cache;
+	wl_list_insert_list(&c->callbacks, &p->callbacks);
+	wl_list_init(&p->callbacks);
+	discarded(&c->feedback);
+	wl_list_insert_list(&c->feedback, &p->feedback);
+	wl_list_init(&p->feedback);
+	if (p->damage.x0 != -1) {
+		damageadd(&c->damage, p->damage.x0, p->damage.y0, p->damage.x1, p->damage.y1);
+		p->damage = nodamage;
+	}
+	if (p->bufdamage.x0 != -1) {
+		damageadd(&c->bufdamage, p->bufdamage.x0, p->bufdamage.y0, p->bufdamage.x1, p->bufdamage.y1);
+		p->bufdamage = nodamage;
+	}
+	c->opaque = p->opaque;
+	if (c->buffer != p->buffer) {
+		if (c->buffer) {
+			/* superseded before it was ever shown */
+			if (c->buffer != s->state.buffer)
+				wl_buffer_send_release(c->buffer);
+			wl_list_remove(&c->buffer_destroy.link);
+		}
+		if (p->buffer)
+			wl_resource_add_destroy_listener(p->buffer, &c->buffer_destroy);
+		c->buffer = p->buffer;
+	}
+	c->srcx = p->srcx, c->srcy = p->srcy;
+	c->srcw = p->srcw, c->srch = p->srch;
+	c->dstw = p->dstw, c->dsth = p->dsth;
+	c->scale = p->scale;
+	s->cached = 1;
+	viewportcheck(s, c);
 }
 
+/* apply the cached state of s, as its parent applies its own */
 static void
-set_input_region(struct wl_client *c, struct wl_resource *r, struct wl_resource *reg)
+cacheapply(struct surface *s)
 {
+	s->cached = 0;
+	stateapply(s, &s->cache);
+	if (s->cache.buffer) {
+		wl_list_remove(&s->cache.buffer_destroy.link);
+		s->cache.buffer = NULL;
+	}
+	if (s->sub)
+		subsurfaceresize(s);
+	subsurfaceapply(s);
 }
 
 static void
@@ -873,19 +2306,14 @@ commit(struct wl_client *c, struct wl_resource *r)
 	struct surface *s;
 
 	s = wl_resource_get_user_data(r);
-	wl_list_insert_list(&s->state.callbacks, &s->pending.callbacks);
-	wl_list_init(&s->pending.callbacks);
+	if (s->sub && subsurfacesync(s->sub)) {
+		statecache(s);
+		return;
+	}
+	if (stateapply(s, &s->pending) != 0)
+		return;
 	if (s->commit)
 		s->commit(s);
-	if (s->state.buffer != s->pending.buffer) {
-		if (s->state.buffer) {
-			wl_buffer_send_release(s->state.buffer);
-			wl_list_remove(&s->state.buffer_destroy.link);
-		}
-		if (s->pending.buffer)
-			wl_resource_add_destroy_listener(s->pending.buffer, &s->state.buffer_destroy);
-		s->state.buffer = s->pending.buffer;
-	}
 }
 
 static void
@@ -896,8 +2324,14 @@ set_buffer_transform(struct wl_client *c, struct wl_resource *r, int32_t mode)
 static void
 set_buffer_scale(struct wl_client *c, struct wl_resource *r, int32_t scale)
 {
-	if (scale != 1)
-		wl_resource_post_error(r, WL_SURFACE_ERROR_INVALID_SCALE, "set_buffer_scale is not supported");
+	struct surface *s;
+
+	if (scale < 1) {
+		wl_resource_post_error(r, WL_SURFACE_ERROR_INVALID_SCALE, "buffer scale must be positive");
+		return;
+	}
+	s = wl_resource_get_user_data(r);
+	s->pending.scale = scale;
 }
 
 static void
@@ -915,7 +2349,7 @@ static const struct wl_surface_interface surface_impl = {
 	.commit = commit,
 	.set_buffer_transform = set_buffer_transform,
 	.set_buffer_scale = set_buffer_scale,
-	.damage_buffer = damage,
+	.damage_buffer = damage_buffer,
 	.offset = offset,
 };
 
@@ -928,12 +2362,46 @@ surface_buffer_destroyed(struct wl_listener *listener, void *data)
 	state->buffer = NULL;
 }
 
+/* detach a subsurface from its parent and its surface */
+static void
+subsurfaceunlink(struct subsurface *sub)
+{
+	struct surface *p;
+
+	p = sub->parent;
+	if (p) {
+		damageadd(&p->state.damage, sub->x, sub->y, sub->x + sub->w, sub->y + sub->h);
+		wl_list_remove(&sub->link);
+		sub->parent = NULL;
+	}
+	if (sub->surface) {
+		/* the unmapped surface keeps its last committed state */
+		if (sub->surface->cached)
+			cacheapply(sub->surface);
+		sub->surface->sub = NULL;
+		sub->surface->role = NULL;
+		sub->surface->commit = NULL;
+		sub->surface = NULL;
+	}
+}
+
 static void
 destroy_surface(struct wl_resource *r)
 {
 	struct surface *s;
+	struct subsurface *sub, *tmp;
 
 	s = wl_resource_get_user_data(r);
+	if (s->sub)
+		subsurfaceunlink(s->sub);
+	if (s->viewport)
+		wl_resource_set_user_data(s->viewport, NULL);
+	discarded(&s->pending.feedback);
+	discarded(&s->state.feedback);
+	wl_list_for_each_safe(sub, tmp, &s->subsurfaces, link) {
+		wl_list_remove(&sub->link);
+		sub->parent = NULL;
+	}
 	if (s->state.buffer)
 		wl_list_remove(&s->state.buffer_destroy.link);
 	if (s->pending.buffer)
@@ -942,16 +2410,48 @@ destroy_surface(struct wl_resource *r)
 }
 
 /* wl_region */
+
+/* only the largest rectangle is kept, so opaque regions are conservative */
 static void
 region_add(struct wl_client *c, struct wl_resource *r, int32_t x, int32_t y, int32_t w, int32_t h)
 {
+	struct region *region;
+	struct damage *b;
+
+	region = wl_resource_get_user_data(r);
+	b = &region->box;
+	if (w <= 0 || h <= 0)
+		return;
+	if (b->x0 == -1 || (int64_t)w * h > (int64_t)(b->x1 - b->x0) * (b->y1 - b->y0)) {
+		b->x0 = x, b->y0 = y;
+		b->x1 = x + w, b->y1 = y + h;
+	}
+}
+
+static void
+region_subtract(struct wl_client *c, struct wl_resource *r, int32_t x, int32_t y, int32_t w, int32_t h)
+{
+	struct region *region;
+	struct damage *b;
+
+	region = wl_resource_get_user_data(r);
+	b = &region->box;
+	if (b->x0 != -1 && x < b->x1 && y < b->y1 && x + w > b->x0 && y + h > b->y0)
+		*b = nodamage;
 }
 
 static const struct wl_region_interface region_impl = {
 	.destroy = destroy,
 	.add = region_add,
+	.subtract = region_subtract,
 };
 
+static void
+destroy_region(struct wl_resource *r)
+{
+	free(wl_resource_get_user_data(r));
+}
+
 /* wl_compositor */
 static void
 create_surface(struct wl_client *c, struct wl_resource *r, uint32_t id)
@@ -967,17 +2467,32 @@ create_surface(struct wl_client *c, struct wl_resource *r, uint32_t id)
 	if (!s->resource)
 		goto error;
 	s->pending.buffer_destroy.notify = surface_buffer_destroyed;
-	s->pending.damage.x0 = -1;
-	s->pending.damage.y0 = -1;
-	s->pending.damage.x1 = -1;
-	s->pending.damage.y1 = -1;
+	s->pending.damage = nodamage;
+	s->pending.bufdamage = nodamage;
+	s->pending.opaque = nodamage;
+	s->pending.srcw = -1;
+	s->pending.dstw = -1;
+	s->pending.scale = 1;
 	s->state.buffer_destroy.notify = surface_buffer_destroyed;
-	s->state.damage.x0 = -1;
-	s->state.damage.y0 = -1;
-	s->state.damage.x1 = -1;
-	s->state.damage.y1 = -1;
+	s->state.damage = nodamage;
+	s->state.opaque = nodamage;
+	s->state.srcw = -1;
+	s->state.dstw = -1;
+	s->state.scale = 1;
+	s->cache.buffer_destroy.notify = surface_buffer_destroyed;
+	s->cache.damage = nodamage;
+	s->cache.bufdamage = nodamage;
+	s->cache.opaque = nodamage;
+	s->cache.srcw = -1;
+	s->cache.dstw = -1;
+	s->cache.scale = 1;
 	wl_list_init(&s->pending.callbacks);
 	wl_list_init(&s->state.callbacks);
+	wl_list_init(&s->cache.callbacks);
+	wl_list_init(&s->pending.feedback);
+	wl_list_init(&s->state.feedback);
+	wl_list_init(&s->cache.feedback);
+	wl_list_init(&s->subsurfaces);
 	wl_resource_set_implementation(s->resource, &surface_impl, s, destroy_surface);
 	return;
 
@@ -989,16 +2504,23 @@ error:
 static void
 create_region(struct wl_client *c, struct wl_resource *r, uint32_t id)
 {
-	struct wl_resource *nr;
+	struct region *region;
 	uint32_t ver;
 
+	region = malloc(sizeof *region);
+	if (!region)
+		goto error;
+	region->box = nodamage;
 	ver = wl_resource_get_version(r);
-	nr = wl_resource_create(c, &wl_region_interface, ver, id);
-	if (!nr) {
-		wl_client_post_no_memory(c);
-		return;
-	}
-	wl_resource_set_implementation(nr, &region_impl, nr, NULL);
+	region->resource = wl_resource_create(c, &wl_region_interface, ver, id);
+	if (!region->resource)
+		goto error;
+	wl_resource_set_implementation(region->resource, &region_impl, region, destroy_region);
+	return;
+
+error:
+	free(region);
+	wl_client_post_no_memory(c);
 }
 
 static const struct wl_compositor_interface compositor_impl = {
@@ -1019,6 +2541,188 @@ bind_compositor(struct wl_client *c, void *p, uint32_t ver, uint32_t id)
 	wl_resource_set_implementation(r, &compositor_impl, NULL, NULL);
 }
 
+/* wl_subsurface */
+static void toplevel_commit(struct surface *);
+
+/* the window at the root of a surface tree, if any */
+static struct window *
+surfacewindow(struct surface *s)
+{
+	while (s->sub) {
+		s = s->sub->parent;
+		if (!s)
+			return NULL;
+	}
+	return s->commit == toplevel_commit ? wl_resource_get_user_data(s->role) : NULL;
+}
+
+/*
+ * Commits of desynchronized subsurfaces take effect immediately;
+ * those of synchronized ones are cached until the parent applies.
+ */
+static void
+subsurface_commit(struct surface *s)
+{
+	struct window *w;
+
+	subsurfaceresize(s);
+	subsurfaceapply(s);
+	w = surfacewindow(s);
+	if (w && w->wsys != -1)
+		windraw(w);
+}
+
+static void
+subsurface_destroy(struct wl_resource *r)
+{
+	struct subsurface *sub;
+
+	sub = wl_resource_get_user_data(r);
+	subsurfaceunlink(sub);
+	free(sub);
+}
+
+static void
+set_position(struct wl_client *c, struct wl_resource *r, int32_t x, int32_t y)
+{
+	struct subsurface *sub;
+
+	sub = wl_resource_get_user_data(r);
+	sub->nextx = x;
+	sub->nexty = y;
+}
+
+/* stacking changes apply immediately; subsurfaces are never below their parent */
+static void
+restack(struct wl_resource *r, struct wl_resource *sibr, int above)
+{
+	struct subsurface *sub;
+	struct surface *sib;
+
+	sub = wl_resource_get_user_data(r);
+	if (!sub->parent)
+		return;
+	sib = wl_resource_get_user_data(sibr);
+	if (sib != sub->parent && (!sib->sub || sib->sub->parent != sub->parent || sib->sub == sub)) {
+		wl_resource_post_error(r, WL_SUBSURFACE_ERROR_BAD_SURFACE, "not a sibling or parent");
+		return;
+	}
+	wl_list_remove(&sub->link);
+	if (sib == sub->parent)
+		wl_list_insert(&sub->parent->subsurfaces, &sub->link);
+	else
+		wl_list_insert(above ? &sib->sub->link : sib->sub->link.prev, &sub->link);
+	damageadd(&sub->surface->state.damage, 0, 0, sub->w, sub->h);
+}
+
+static void
+place_above(struct wl_client *c, struct wl_resource *r, struct wl_resource *sibr)
+{
+	restack(r, sibr, 1);
+}
+
+static void
+place_below(struct wl_client *c, struct wl_resource *r, struct wl_resource *sibr)
+{
+	restack(r, sibr, 0);
+}
+
+static void
+set_sync(struct wl_client *c, struct wl_resource *r)
+{
+	struct subsurface *sub;
+
+	sub = wl_resource_get_user_data(r);
+	sub->sync = 1;
+}
+
+static void
+set_desync(struct wl_client *c, struct wl_resource *r)
+{
+	struct subsurface *sub;
+	struct surface *s;
+	struct window *w;
+
+	sub = wl_resource_get_user_data(r);
+	sub->sync = 0;
+	s = sub->surface;
+	if (s && s->cached && !subsurfacesync(sub)) {
+		cacheapply(s);
+		w = surfacewindow(s);
+		if (w && w->wsys != -1)
+			windraw(w);
+	}
+}
+
+static const struct wl_subsurface_interface subsurface_impl = {
+	.destroy = destroy,
+	.set_position = set_position,
+	.place_above = place_above,
+	.place_below = place_below,
+	.set_sync = set_sync,
+	.set_desync = set_desync,
+};
+
+/* wl_subcompositor */
+static void
+get_subsurface(struct wl_client *c, struct wl_resource *r, uint32_t id, struct wl_resource *sr, struct wl_resource *pr)
+{
+	struct subsurface *sub;
+	struct surface *s, *p, *q;
+	uint32_t ver;
+
+	s = wl_resource_get_user_data(sr);
+	p = wl_resource_get_user_data(pr);
+	if (s->commit) {
+		wl_resource_post_error(r, WL_SUBCOMPOSITOR_ERROR_BAD_SURFACE, "surface already has a role");
+		return;
+	}
+	for (q = p; q; q = q->sub ? q->sub->parent : NULL) {
+		if (q == s) {
+			wl_resource_post_error(r, WL_SUBCOMPOSITOR_ERROR_BAD_PARENT, "parent is the surface or its descendant");
+			return;
+		}
+	}
+	sub = calloc(1, sizeof *sub);
+	if (!sub)
+		goto error;
+	ver = wl_resource_get_version(r);
+	sub->resource = wl_resource_create(c, &wl_subsurface_interface, ver, id);
+	if (!sub->resource)
+		goto error;
+	wl_resource_set_implementation(sub->resource, &subsurface_impl, sub, subsurface_destroy);
+	sub->surface = s;
+	sub->parent = p;
+	sub->sync = 1;
+	wl_list_insert(p->subsurfaces.prev, &sub->link);
+	s->sub = sub;
+	s->role = sub->resource;
+	s->commit = subsurface_commit;
+	return;
+
+error:
+	free(sub);
+	wl_client_post_no_memory(c);
+}
+
+static const struct wl_subcompositor_interface subcompositor_impl = {
+	.destroy = destroy,
+	.get_subsurface = get_subsurface,
+};
+
+static void
+bind_subcompositor(struct wl_client *c, void *p, uint32_t ver, uint32_t id)
+{
+	struct wl_resource *r;
+
+	r = wl_resource_create(c, &wl_subcompositor_interface, ver, id);
+	if (!r) {
+		wl_client_post_no_memory(c);
+		return;
+	}
+	wl_resource_set_implementation(r, &subcompositor_impl, NULL, NULL);
+}
+
 /* xdg_toplevel */
 static void
 set_parent(struct wl_client *c, struct wl_resource *r, struct wl_resource *p)
@@ -1109,90 +2813,338 @@ static const struct xdg_toplevel_interface toplevel_impl = {
 };
 
 static void
-toplevel_commit(struct surface *s)
+toplevel_commit(struct surface *s)
+{
+	struct window *w;
+	struct wl_resource *r;
+	struct wl_client *c;
+
+	TRACEBEGIN(span);
+	w = wl_resource_get_user_data(s->role);
+	if (w->initial_commit) {
+		c = wl_resource_get_client(w->xdgsurface);
+		r = wl_resource_find_for_client(&output.resources, c);
+		if (r)
+			wl_surface_send_enter(s->resource, r);
+
+		winnew(w);
+		w->initial_commit = 0;
+	}
+	if (w->inputtime && !w->committime) {
+		w->committime = nsec();
+		histadd(&w->commitlat, (w->committime - w->inputtime) / 1000);
+	}
+	subsurfaceapply(s);
+	windraw(w);
+	TRACEEND(span, "toplevel_commit");
+}
+
+static void
+toplevel_destroy(struct wl_resource *r)
+{
+	struct window *w;
+	char buf[5];
+
+	w = wl_resource_get_user_data(r);
+	if (w->wsys != -1) {
+		fsclunk(&termctx, NULL, w->wsys);
+		fsclunk(&termctx, NULL, w->wctl);
+		if (w->wctltag != -1)
+			fsflush(&termctx, w->wctltag);
+		fsclunk(&termctx, NULL, w->winname);
+		fsclunk(&termctx, NULL, w->label);
+		fsclunk(&termctx, NULL, w->cursor);
+		inputstop(&w->mouse);
+		inputstop(&w->kbd);
+	}
+	while (!wl_list_empty(&w->popups))
+		popuphide(wl_container_of(w->popups.next, (struct popup *)NULL, link));
+	if (w->image != -1) {
+		buf[0] = 'f';
+		putle32(buf + 1, w->image);
+		if (fswrite(draw.ctx, NULL, draw.datafid, 0, buf, sizeof buf) != 0)
+			fprintf(stderr, "fswrite %s draw: %s\n", w->name, strerror(errno));
+	}
+	if (cursor.w == w)
+		cursor.w = NULL;
+	w->toplevel = NULL;
+	w->surface->role = NULL;
+	w->surface->commit = NULL;
+}
+
+/* xdg_popup */
+
+/* direction of an anchor or gravity along one axis: -1, 0 or 1 */
+static int
+edgedir(uint32_t e, int vertical)
+{
+	switch (e) {
+	case XDG_POSITIONER_ANCHOR_TOP:          return vertical ? -1 : 0;
+	case XDG_POSITIONER_ANCHOR_BOTTOM:       return vertical ? 1 : 0;
+	case XDG_POSITIONER_ANCHOR_LEFT:         return vertical ? 0 : -1;
+	case XDG_POSITIONER_ANCHOR_RIGHT:        return vertical ? 0 : 1;
+	case XDG_POSITIONER_ANCHOR_TOP_LEFT:     return -1;
+	case XDG_POSITIONER_ANCHOR_BOTTOM_LEFT:  return vertical ? 1 : -1;
+	case XDG_POSITIONER_ANCHOR_TOP_RIGHT:    return vertical ? -1 : 1;
+	case XDG_POSITIONER_ANCHOR_BOTTOM_RIGHT: return 1;
+	}
+	return 0;
+}
+
+static int
+placepoint(int a0, int a1, int anchor, int gravity, int off, int size)
+{
+	int p;
+
+	p = (anchor < 0 ? a0 : anchor > 0 ? a1 : (a0 + a1) / 2) + off;
+	return gravity < 0 ? p - size : gravity > 0 ? p : p - size / 2;
+}
+
+/*
+ * Place a popup along one axis, then keep it within lo..hi by
+ * flipping, sliding or resizing, as the positioner allows.
+ */
+static void
+placeaxis(int *pos, int *size, int a0, int a1, int anchor, int gravity, int off, int lo, int hi, uint32_t flip, uint32_t slide, uint32_t resize)
+{
+	int p, q;
+
+	p = placepoint(a0, a1, anchor, gravity, off, *size);
+	if (flip && (p < lo || p + *size > hi)) {
+		q = placepoint(a0, a1, -anchor, -gravity, -off, *size);
+		if (q >= lo && q + *size <= hi)
+			p = q;
+	}
+	if (slide) {
+		if (p + *size > hi)
+			p = hi - *size;
+		if (p < lo)
+			p = lo;
+	}
+	if (resize) {
+		if (p < lo)
+			*size -= lo - p, p = lo;
+		if (p + *size > hi)
+			*size = hi - p;
+		if (*size < 1)
+			*size = 1;
+	}
+	*pos = p;
+}
+
+/* place a popup within its toplevel, since it cannot be drawn outside */
+static void
+popupplace(struct popup *p, const struct positioner *pos)
+{
+	struct window *top;
+	int x0, y0, x1, y1;
+
+	top = wintop(p->parent, &x0, &y0);
+	if (top && top->x1 > top->x0) {
+		x1 = top->x1 - top->x0 - x0;
+		y1 = top->y1 - top->y0 - y0;
+		x0 = -x0;
+		y0 = -y0;
+	} else {
+		x0 = y0 = INT_MIN / 2;
+		x1 = y1 = INT_MAX / 2;
+	}
+	p->width = pos->w;
+	p->height = pos->h;
+	placeaxis(&p->x, &p->width, pos->anchor.x0, pos->anchor.x1,
+		edgedir(pos->edge, 0), edgedir(pos->gravity, 0), pos->dx, x0, x1,
+		pos->adjust & XDG_POSITIONER_CONSTRAINT_ADJUSTMENT_FLIP_X,
+		pos->adjust & XDG_POSITIONER_CONSTRAINT_ADJUSTMENT_SLIDE_X,
+		pos->adjust & XDG_POSITIONER_CONSTRAINT_ADJUSTMENT_RESIZE_X);
+	placeaxis(&p->y, &p->height, pos->anchor.y0, pos->anchor.y1,
+		edgedir(pos->edge, 1), edgedir(pos->gravity, 1), pos->dy, y0, y1,
+		pos->adjust & XDG_POSITIONER_CONSTRAINT_ADJUSTMENT_FLIP_Y,
+		pos->adjust & XDG_POSITIONER_CONSTRAINT_ADJUSTMENT_SLIDE_Y,
+		pos->adjust & XDG_POSITIONER_CONSTRAINT_ADJUSTMENT_RESIZE_Y);
+}
+
+static void
+popupconfigure(struct popup *p)
+{
+	xdg_popup_send_configure(p->resource, p->x, p->y, p->width, p->height);
+	p->w->serial = wl_display_next_serial(dpy);
+	xdg_surface_send_configure(p->w->xdgsurface, p->w->serial);
+}
+
+/* restore what the popup covers from its backing image */
+static void
+popuphide(struct popup *p)
 {
-	struct window *w;
-	struct drawcopy d;
-	struct wl_resource *r;
-	struct wl_client *c;
-	size_t n;
-
-	w = wl_resource_get_user_data(s->role);
-	if (w->initial_commit) {
-		c = wl_resource_get_client(w->xdgsurface);
-		r = wl_resource_find_for_client(&output.resources, c);
-		if (r)
-			wl_surface_send_enter(s->resource, r);
+	struct window *top;
+	struct wl_list *above;
+	unsigned char *pos;
 
-		winnew(w);
-		w->initial_commit = 0;
+	top = p->top;
+	if (!top)
+		return;
+	above = p->link.next;
+	wl_list_remove(&p->link);
+	p->top = NULL;
+	pos = draw.buf;
+	if (top->image != -1) {
+		pos = drawd(pos, top->image, p->backing, (int[]){top->x0 + p->r.x0, top->y0 + p->r.y0, top->x0 + p->r.x1, top->y0 + p->r.y1}, 0, 0);
+		pos = popupsdraw(pos, top, above, &p->r);
+		*pos++ = 'v';
 	}
+	pos = drawf(pos, p->image);
+	pos = drawf(pos, p->backing);
+	drawsend(pos);
+	numput(&draw.imgid, p->image);
+	numput(&draw.imgid, p->backing);
+	p->image = -1;
+	p->backing = -1;
+}
 
-	d.w = w;
-	d.b = wl_shm_buffer_get(s->pending.buffer);
-	if (!d.b)
-		return;
-	d.d = s->pending.damage;
-	if (d.d.x0 == -1)
-		return;
-	if (d.d.x1 > w->x1 - w->x0)
-		d.d.x1 = w->x1 - w->x0;
-	if (d.d.y1 > w->y1 - w->y0)
-		d.d.y1 = w->y1 - w->y0;
-	d.x = d.d.x0;
-	d.y = d.d.y0;
-	d.dx = d.d.x1 - d.d.x0;
-	n = draw.buflen - 22;
-	if (n < 4 * d.dx) {
-		d.dx = (4 * d.dx + n - 1) / n;
-		d.dy = 1;
+/*
+ * Upload the popup's damage to its off-screen image and draw that
+ * part onto the toplevel. When first shown, what it covers is saved
+ * to a backing image.
+ */
+static void
+popupshow(struct popup *p)
+{
+	struct surface *s;
+	struct wl_shm_buffer *b;
+	struct window *top;
+	struct drawcopy d;
+	struct damage c;
+	struct scaler sc;
+	unsigned char *pos;
+	uint32_t chan;
+	int x, y, width, height, kx, ky, repl;
+
+	if (p->w->upload) {
+		p->w->redraw = 1;
+		return;
+	}
+	s = p->w->surface;
+	b = wl_shm_buffer_get(s->state.buffer);
+	top = wintop(p->parent, &x, &y);
+	if (!b || !top || top->image == -1 || p->parent->popup && !p->parent->popup->top) {
+		popuphide(p);
+		return;
+	}
+	x += p->x;
+	y += p->y;
+	surfacesize(s, &width, &height);
+	chan = wl_shm_buffer_get_format(b) == WL_SHM_FORMAT_ARGB8888 ? ARGB32 : XRGB32;
+	if (p->top && (p->r.x0 != x || p->r.y0 != y || p->r.x1 != x + width || p->r.y1 != y + height || p->chan != chan))
+		popuphide(p);
+	if (!p->top) {
+		p->image = numget(&draw.imgid);
+		p->backing = p->image < 0 ? -1 : numget(&draw.imgid);
+		if (p->backing < 0) {
+			if (p->image >= 0)
+				numput(&draw.imgid, p->image);
+			fprintf(stderr, "popup: no free image ids\n");
+			return;
+		}
+		p->chan = chan;
+		p->r.x0 = x, p->r.y0 = y;
+		p->r.x1 = x + width, p->r.y1 = y + height;
+		pos = drawb(draw.buf, p->image, chan, 0, (int[]){0, 0, width, height}, 0);
+		pos = drawb(pos, p->backing, XRGB32, 0, (int[]){0, 0, width, height}, 0);
+		pos = drawd(pos, p->backing, top->image, (int[]){0, 0, width, height}, top->x0 + x, top->y0 + y);
+		drawsend(pos);
+		p->top = top;
+		wl_list_insert(top->popups.prev, &p->link);
+		damageadd(&s->state.damage, 0, 0, width, height);
+	}
+	treedamage(s, 0, 0, &s->state.damage);
+	d.d = s->state.damage;
+	/* the scratch images are opaque, so only opaque popups are replicated */
+	repl = chan == XRGB32 && wl_list_empty(&s->subsurfaces) && surfacerepl(s, b, &sc, &kx, &ky);
+	if (repl) {
+		free(p->w->stage);
+		p->w->stage = NULL;
+	} else if (wl_list_empty(&s->subsurfaces) && !surfacescaled(s)) {
+		free(p->w->stage);
+		p->w->stage = NULL;
+		d.img = wl_shm_buffer_get_data(b);
+		d.stride = wl_shm_buffer_get_stride(b);
 	} else {
-		d.dy = n / (4 * d.dx);
+		if (winstage(p->w, width, height, &d.d) != 0)
+			return;
+		d.img = (unsigned char *)p->w->stage;
+		d.stride = (size_t)width * 4;
+	}
+	if (!damageclip(&d.d, width, height))
+		return;
+	d.w = p->w;
+	d.image = p->image;
+	d.ox = 0;
+	d.oy = 0;
+	d.flush = 0;
+	if (repl) {
+		pos = drawrepl(&d, &sc, kx, ky);
+	} else {
+		drawcopyinit(&d);
+		drawcopy(&d);
+		pos = draw.buf;
 	}
-	drawcopy(&d);
+	s->state.damage = nodamage;
+	if (d.tag == -1) {
+		drawwait(p->w, -1);
+		return;
+	}
+	c.x0 = x + d.d.x0, c.y0 = y + d.d.y0;
+	c.x1 = x + d.d.x1, c.y1 = y + d.d.y1;
+	pos = drawd(pos, top->image, p->image, (int[]){top->x0 + c.x0, top->y0 + c.y0, top->x0 + c.x1, top->y0 + c.y1}, d.d.x0, d.d.y0);
+	pos = popupsdraw(pos, top, p->link.next, &c);
+	*pos++ = 'v';
+	drawflush(pos, p->w);
 }
 
 static void
-toplevel_destroy(struct wl_resource *r)
+popup_commit(struct surface *s)
 {
-	struct window *w;
-	char buf[5];
+	struct popup *p;
 
-	w = wl_resource_get_user_data(r);
-	if (w->wsys != -1) {
-		fsclunk(&termctx, w->wsys);
-		fsclunk(&termctx, w->wctl);
-		if (w->wctltag != -1)
-			fsflush(&termctx, w->wctltag);
-		fsclunk(&termctx, w->winname);
-		fsclunk(&termctx, w->label);
-		fsclunk(&termctx, w->mouse);
-		if (w->mousetag != -1)
-			fsflush(&termctx, w->mousetag);
-		fsclunk(&termctx, w->kbd);
-		if (w->kbdtag != -1)
-			fsflush(&termctx, w->kbdtag);
-	}
-	if (w->image != -1) {
-		buf[0] = 'f';
-		putle32(buf + 1, w->image);
-		if (fswrite(&termctx, NULL, draw.datafid, 0, buf, sizeof buf) != 0)
-			fprintf(stderr, "fswrite %s draw: %s\n", w->name, strerror(errno));
+	p = wl_resource_get_user_data(s->role);
+	if (p->w->initial_commit) {
+		p->w->initial_commit = 0;
+		popupconfigure(p);
+		return;
 	}
-	w->toplevel = NULL;
-	w->surface->role = NULL;
-	w->surface->commit = NULL;
+	popupshow(p);
+}
+
+static void
+popup_destroy(struct wl_resource *r)
+{
+	struct popup *p;
+
+	p = wl_resource_get_user_data(r);
+	popuphide(p);
+	p->w->popup = NULL;
+	p->w->surface->role = NULL;
+	p->w->surface->commit = NULL;
+	free(p);
 }
 
-/* xdg_popup */
 static void
 grab(struct wl_client *c, struct wl_resource *r, struct wl_resource *seat, uint32_t serial)
 {
+	struct popup *p;
+
+	p = wl_resource_get_user_data(r);
+	p->grab = 1;
 }
 
 static void
-reposition(struct wl_client *c, struct wl_resource *r, struct wl_resource *pos, uint32_t token)
+reposition(struct wl_client *c, struct wl_resource *r, struct wl_resource *posr, uint32_t token)
 {
+	struct popup *p;
+
+	p = wl_resource_get_user_data(r);
+	popupplace(p, wl_resource_get_user_data(posr));
+	xdg_popup_send_repositioned(r, token);
+	popupconfigure(p);
 }
 
 static const struct xdg_popup_interface popup_impl = {
@@ -1221,21 +3173,23 @@ offer_receive(struct wl_client *c, struct wl_resource *r, const char *mime, int3
 	struct snarfget *get;
 	C9tag tag;
 
-	get = malloc(sizeof *get);
+	get = calloc(1, sizeof *get);
 	if (!get) {
 		perror(NULL);
 		close(fd);
 		return;
 	}
 	get->fd = fd;
-	get->offset = 0;
 	get->offer = r;
-	if (fsread(&termctx, &tag, NULL, term.snarf, 0, 1024) != 0) {
+	get->readsz = termctx.msize - IOHDRSZ;
+	get->len = SIZE_MAX;
+	if (fsstat(&termctx, &tag, NULL, term.snarf) != 0) {
+		fprintf(stderr, "stat /dev/snarf: %s\n", termaux.err);
 		close(fd);
 		free(get);
 		return;
 	}
-	fsasync(&termctx, tag, snarfget, get);
+	fsasync(&termctx, tag, snarfstat, get);
 }
 
 static void
@@ -1278,16 +3232,42 @@ get_toplevel(struct wl_client *c, struct wl_resource *r, uint32_t id)
 static void
 get_popup(struct wl_client *c, struct wl_resource *r, uint32_t id, struct wl_resource *parentr, struct wl_resource *posr)
 {
-	struct wl_resource *pr;
+	struct window *w;
+	struct positioner *pos;
+	struct popup *p;
 	uint32_t ver;
 
-	ver = wl_resource_get_version(r);
-	pr = wl_resource_create(c, &xdg_popup_interface, ver, id);
-	if (!pr) {
-		wl_client_post_no_memory(c);
+	w = wl_resource_get_user_data(r);
+	pos = wl_resource_get_user_data(posr);
+	if (w->surface->commit) {
+		wl_resource_post_error(r, XDG_SURFACE_ERROR_ALREADY_CONSTRUCTED, "surface already has a role");
+		return;
+	}
+	if (pos->w <= 0 || pos->h <= 0 || !pos->anchorset) {
+		wl_resource_post_error(r, XDG_WM_BASE_ERROR_INVALID_POSITIONER, "incomplete positioner");
 		return;
 	}
-	wl_resource_set_implementation(pr, &popup_impl, NULL, NULL);
+	p = calloc(1, sizeof *p);
+	if (!p)
+		goto error;
+	ver = wl_resource_get_version(r);
+	p->resource = wl_resource_create(c, &xdg_popup_interface, ver, id);
+	if (!p->resource)
+		goto error;
+	wl_resource_set_implementation(p->resource, &popup_impl, p, popup_destroy);
+	p->w = w;
+	p->parent = parentr ? wl_resource_get_user_data(parentr) : NULL;
+	p->image = -1;
+	p->backing = -1;
+	popupplace(p, pos);
+	w->popup = p;
+	w->surface->role = p->resource;
+	w->surface->commit = popup_commit;
+	return;
+
+error:
+	free(p);
+	wl_client_post_no_memory(c);
 }
 
 static void
@@ -1320,16 +3300,29 @@ xdgsurface_surface_destroyed(struct wl_listener *listener, void *data)
 static void
 xdg_surface_destroy(struct wl_resource *r)
 {
-	struct window *w;
+	struct window *w, *child;
 
 	w = wl_resource_get_user_data(r);
+	wl_list_for_each(child, &windows, link) {
+		if (child->popup && child->popup->parent == w) {
+			popuphide(child->popup);
+			child->popup->parent = NULL;
+			xdg_popup_send_popup_done(child->popup->resource);
+		}
+	}
 	wl_list_remove(&w->surface_destroy.link);
+	wl_list_remove(&w->link);
 	if (w->surface->role)
 		wl_resource_destroy(w->surface->role);
 	if (kbd.focus == w)
 		kbdfocus(NULL);
 	if (mouse.focus == w)
 		mousefocus(NULL, 0, 0);
+	if (cursor.w == w)
+		cursor.w = NULL;
+	if (w->upload)
+		w->upload->w = NULL;
+	free(w->stage);
 	free(w);
 }
 
@@ -1337,31 +3330,67 @@ xdg_surface_destroy(struct wl_resource *r)
 static void
 set_size(struct wl_client *c, struct wl_resource *r, int32_t w, int32_t h)
 {
+	struct positioner *pos;
+
+	if (w <= 0 || h <= 0) {
+		wl_resource_post_error(r, XDG_POSITIONER_ERROR_INVALID_INPUT, "invalid size");
+		return;
+	}
+	pos = wl_resource_get_user_data(r);
+	pos->w = w;
+	pos->h = h;
 }
 
 static void
 set_anchor_rect(struct wl_client *c, struct wl_resource *r, int32_t x, int32_t y, int32_t w, int32_t h)
 {
+	struct positioner *pos;
+
+	if (w < 0 || h < 0) {
+		wl_resource_post_error(r, XDG_POSITIONER_ERROR_INVALID_INPUT, "invalid anchor rectangle");
+		return;
+	}
+	pos = wl_resource_get_user_data(r);
+	pos->anchor.x0 = x, pos->anchor.y0 = y;
+	pos->anchor.x1 = x + w, pos->anchor.y1 = y + h;
+	pos->anchorset = 1;
 }
 
 static void
 set_anchor(struct wl_client *c, struct wl_resource *r, uint32_t anchor)
 {
+	struct positioner *pos;
+
+	pos = wl_resource_get_user_data(r);
+	pos->edge = anchor;
 }
 
 static void
 set_gravity(struct wl_client *c, struct wl_resource *r, uint32_t gravity)
 {
+	struct positioner *pos;
+
+	pos = wl_resource_get_user_data(r);
+	pos->gravity = gravity;
 }
 
 static void
 set_constraint_adjustment(struct wl_client *c, struct wl_resource *r, uint32_t adj)
 {
+	struct positioner *pos;
+
+	pos = wl_resource_get_user_data(r);
+	pos->adjust = adj;
 }
 
 static void
 set_offset(struct wl_client *c, struct wl_resource *r, int32_t x, int32_t y)
 {
+	struct positioner *pos;
+
+	pos = wl_resource_get_user_data(r);
+	pos->dx = x;
+	pos->dy = y;
 }
 
 static void
@@ -1393,19 +3422,32 @@ static const struct xdg_positioner_interface positioner_impl = {
 };
 
 /* xdg_wm_base */
+static void
+destroy_positioner(struct wl_resource *r)
+{
+	free(wl_resource_get_user_data(r));
+}
+
 static void
 create_positioner(struct wl_client *c, struct wl_resource *r, uint32_t id)
 {
 	struct wl_resource *pr;
+	struct positioner *pos;
 	uint32_t ver;
 
+	pos = calloc(1, sizeof *pos);
+	if (!pos)
+		goto error;
 	ver = wl_resource_get_version(r);
 	pr = wl_resource_create(c, &xdg_positioner_interface, ver, id);
-	if (!pr) {
-		wl_client_post_no_memory(c);
-		return;
-	}
-	wl_resource_set_implementation(pr, &positioner_impl, NULL, NULL);
+	if (!pr)
+		goto error;
+	wl_resource_set_implementation(pr, &positioner_impl, pos, destroy_positioner);
+	return;
+
+error:
+	free(pos);
+	wl_client_post_no_memory(c);
 }
 
 static void
@@ -1424,19 +3466,25 @@ get_xdg_surface(struct wl_client *c, struct wl_resource *r, uint32_t id, struct
 	if (!w->xdgsurface)
 		goto error;
 	wl_array_init(&w->keys);
+	wl_list_init(&w->popups);
 	w->surface = s;
 	w->initial_commit = 1;
 	w->surface_destroy.notify = xdgsurface_surface_destroyed;
 	wl_resource_add_destroy_listener(s->resource, &w->surface_destroy);
+	wl_list_insert(&windows, &w->link);
 	w->wsys = -1;
 	w->wctl = -1;
 	w->wctltag = -1;
 	w->winname = -1;
 	w->label = -1;
-	w->mouse = -1;
-	w->mousetag = -1;
-	w->kbd = -1;
-	w->kbdtag = -1;
+	w->mouse.w = w;
+	w->mouse.fid = -1;
+	w->mouse.size = 49;
+	w->mouse.event = mouseevent;
+	w->kbd.w = w;
+	w->kbd.fid = -1;
+	w->kbd.size = 256;
+	w->kbd.event = kbdevents;
 	wl_resource_set_implementation(w->xdgsurface, &xdg_surface_impl, w, xdg_surface_destroy);
 	return;
 
@@ -1471,10 +3519,212 @@ bind_wm(struct wl_client *c, void *p, uint32_t ver, uint32_t id)
 }
 
 /* wl_pointer */
+
+/*
+ * Convert an ARGB cursor image to a 16x16 Plan 9 cursor, scaling
+ * larger images down by an integer factor. Opaque pixels are drawn
+ * black or white depending on their luminance. Images are cached by
+ * a hash of their contents and hotspot.
+ */
+static struct cursor *
+cursorconvert(struct wl_shm_buffer *b, int hotx, int hoty)
+{
+	struct cursor *cur;
+	unsigned char *data, *row, *clr, *set;
+	uint32_t fmt, p;
+	uint64_t hash;
+	int width, height, stride, scale, x, y, i, j, a, l, n;
+
+	fmt = wl_shm_buffer_get_format(b);
+	if (fmt != WL_SHM_FORMAT_ARGB8888 && fmt != WL_SHM_FORMAT_XRGB8888)
+		return NULL;
+	width = wl_shm_buffer_get_width(b);
+	height = wl_shm_buffer_get_height(b);
+	stride = wl_shm_buffer_get_stride(b);
+	wl_shm_buffer_begin_access(b);
+	data = wl_shm_buffer_get_data(b);
+
+	/* FNV-1a over the pixels, then the geometry */
+	hash = 0xcbf29ce484222325;
+	for (y = 0; y < height; ++y) {
+		row = data + y * stride;
+		for (i = 0; i < width * 4; ++i)
+			hash = (hash ^ row[i]) * 0x100000001b3;
+	}
+	hash = (hash ^ fmt) * 0x100000001b3;
+	hash = (hash ^ (uint32_t)width) * 0x100000001b3;
+	hash = (hash ^ (uint32_t)height) * 0x100000001b3;
+	hash = (hash ^ (uint32_t)hotx) * 0x100000001b3;
+	hash = (hash ^ (uint32_t)hoty) * 0x100000001b3;
+	hash |= 1;
+	for (cur = cursor.cache; cur < cursor.cache + CURSORCACHE; ++cur) {
+		if (cur->hash == hash) {
+			wl_shm_buffer_end_access(b);
+			return cur;
+		}
+	}
+
+	cur = &cursor.cache[cursor.cachenext];
+	cursor.cachenext = (cursor.cachenext + 1) % CURSORCACHE;
+	cur->hash = hash;
+	memset(cur->data, 0, sizeof cur->data);
+	scale = ((width > height ? width : height) + 15) / 16;
+	if (scale < 1)
+		scale = 1;
+	putle32(cur->data, -hotx / scale);
+	putle32(cur->data + 4, -hoty / scale);
+	clr = cur->data + 8;
+	set = cur->data + 40;
+	for (y = 0; y < 16 && y * scale < height; ++y) {
+		for (x = 0; x < 16 && x * scale < width; ++x) {
+			a = l = n = 0;
+			for (j = y * scale; j < (y + 1) * scale && j < height; ++j) {
+				row = data + j * stride;
+				for (i = x * scale; i < (x + 1) * scale && i < width; ++i, ++n) {
+					p = getle32(row + i * 4);
+					a += fmt == WL_SHM_FORMAT_ARGB8888 ? p >> 24 : 0xff;
+					/* premultiplied, so luminance is at most alpha */
+					l += ((p >> 16 & 0xff) * 77 + (p >> 8 & 0xff) * 150 + (p & 0xff) * 29) >> 8;
+				}
+			}
+			if (a * 2 < n * 0xff)
+				continue;
+			if (l * 2 < a)
+				set[y * 2 + x / 8] |= 0x80 >> x % 8;
+			else
+				clr[y * 2 + x / 8] |= 0x80 >> x % 8;
+		}
+	}
+	wl_shm_buffer_end_access(b);
+	return cur;
+}
+
+static void
+cursorwritten(C9r *r, void *aux)
+{
+	if (r->type == Rerror)
+		fprintf(stderr, "write cursor: %s\n", r->error);
+}
+
+/* write the cursor image in buffer to the window that set it */
+static void
+cursorwrite(struct wl_resource *buffer)
+{
+	static const struct cursor blank = {.hash = 2};
+	const struct cursor *cur;
+	struct wl_shm_buffer *b;
+	struct wl_resource *r, *tmp;
+	struct window *w;
+	C9tag tag;
+	int x, y, k;
+
+	w = cursor.w;
+	if (!w || w != mouse.focus)
+		goto done;
+	/* popups are drawn in their toplevel's window */
+	w = wintop(w, &x, &y);
+	if (!w || w->wsys == -1)
+		goto done;
+	/* a cursor surface without a buffer hides the cursor */
+	cur = NULL;
+	b = buffer ? wl_shm_buffer_get(buffer) : NULL;
+	/* the hotspot is in surface coordinates, the image in buffer pixels */
+	if (b) {
+		k = cursor.surface ? cursor.surface->state.scale : 1;
+		cur = cursorconvert(b, cursor.hotx * k, cursor.hoty * k);
+	}
+	if (!cur)
+		cur = &blank;
+	if (cur->hash == w->cursorhash)
+		goto done;
+	if (fswrite(&termctx, &tag, w->cursor, 0, cur->data, sizeof cur->data) != 0) {
+		fprintf(stderr, "fswrite cursor: %s\n", termaux.err);
+		goto done;
+	}
+	fsasync(&termctx, tag, cursorwritten, NULL);
+	w->cursorhash = cur->hash;
+	cursor.last = nsec();
+
+done:
+	if (cursor.surface) {
+		wl_resource_for_each_safe(r, tmp, &cursor.surface->state.callbacks) {
+			wl_callback_send_done(r, 0);
+			wl_resource_destroy(r);
+		}
+	}
+}
+
+/*
+ * Update the cursor, at most once per CURSORRATE so that animated
+ * cursors do not flood the connection. Frame callbacks are held
+ * until the write, which paces the animation.
+ */
+static void
+cursorupdate(struct wl_resource *buffer)
+{
+	uint64_t elapsed;
+
+	if (cursor.waiting)
+		return;
+	elapsed = (nsec() - cursor.last) / 1000000;
+	if (cursor.last && elapsed < CURSORRATE) {
+		cursor.waiting = 1;
+		wl_event_source_timer_update(cursor.timer, CURSORRATE - elapsed);
+		return;
+	}
+	cursorwrite(buffer);
+}
+
+static int
+cursortimer(void *data)
+{
+	cursor.waiting = 0;
+	cursorwrite(cursor.surface ? cursor.surface->state.buffer : NULL);
+	return 0;
+}
+
+static void
+cursor_commit(struct surface *s)
+{
+	cursorupdate(s->state.buffer);
+}
+
+static void
+cursor_surface_destroyed(struct wl_listener *listener, void *data)
+{
+	wl_list_remove(&cursor.surface_destroy.link);
+	cursor.surface = NULL;
+}
+
 static void
 set_cursor(struct wl_client *c, struct wl_resource *r, uint32_t serial, struct wl_resource *sr, int32_t x, int32_t y)
 {
-	/* TODO: implement */
+	struct window *w;
+	struct surface *s;
+
+	w = mouse.focus;
+	if (!w || wl_resource_get_client(w->xdgsurface) != c)
+		return;
+	s = sr ? wl_resource_get_user_data(sr) : NULL;
+	if (s && s->commit && s->commit != cursor_commit) {
+		wl_resource_post_error(r, WL_POINTER_ERROR_ROLE, "surface already has a role");
+		return;
+	}
+	if (cursor.surface && cursor.surface != s) {
+		wl_list_remove(&cursor.surface_destroy.link);
+		cursor.surface->commit = NULL;
+		cursor.surface = NULL;
+	}
+	if (s && !cursor.surface) {
+		cursor.surface_destroy.notify = cursor_surface_destroyed;
+		wl_resource_add_destroy_listener(sr, &cursor.surface_destroy);
+		s->commit = cursor_commit;
+		cursor.surface = s;
+	}
+	cursor.w = w;
+	cursor.hotx = x;
+	cursor.hoty = y;
+	cursorupdate(s ? s->state.buffer : NULL);
 }
 
 static const struct wl_pointer_interface pointer_impl = {
@@ -1523,7 +3773,9 @@ get_keyboard(struct wl_client *c, struct wl_resource *r, uint32_t id)
 		return;
 	}
 	wl_resource_set_implementation(nr, &keyboard_impl, NULL, unlink_resource);
-	wl_keyboard_send_keymap(nr, WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1, kbd.keymapfd, kbd.keymapsize);
+	/* until /dev/kbmap is read, the keymap is sent when it is */
+	if (kbd.keymapfd >= 0)
+		wl_keyboard_send_keymap(nr, WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1, kbd.keymapfd, kbd.keymapsize);
 	w = kbd.focus;
 	active = w && wl_resource_get_client(r) == wl_resource_get_client(w->xdgsurface);
 	wl_list_insert(active ? &kbd.active : &kbd.inactive, wl_resource_get_link(nr));
@@ -1599,94 +3851,254 @@ static void
 set_selection(struct wl_client *c, struct wl_resource *r, struct wl_resource *source, uint32_t serial)
 {
 	struct snarfput *put;
+	size_t len;
 	int fd[2];
 
-	put = malloc(sizeof *put);
+	/* the snarf buffer cannot be emptied, so clearing the selection does nothing */
+	if (!source)
+		return;
+	len = termctx.msize - IOHDRSZ;
+	put = malloc(sizeof *put + len);
 	if (!put) {
 		perror(NULL);
 		return;
 	}
+	put->snarf = -1;
+	put->offset = 0;
+	put->writes = 0;
+	put->buflen = len;
+	put->event = NULL;
+	put->source = source;
+	put->source_destroy.notify = snarfput_source_destroyed;
+	wl_resource_add_destroy_listener(source, &put->source_destroy);
 	if (pipe(fd) != 0) {
 		perror("pipe");
-		free(put);
+		snarfdone(put);
 		return;
 	}
 	wl_data_source_send_send(source, "text/plain;charset=utf-8", fd[1]);
 	close(fd[1]);
-	put->offset = 0;
-	put->source = source;
-	put->snarf = fswalk(&termctx, NULL, term.root, (const char *[]){"dev", "snarf", 0});
+	put->fd = fd[0];
+	snarfcache.valid = 0;
+	put->snarf = fsopenpath(&termctx, term.root, (const char *[]){"dev", "snarf", 0}, C9write);
 	if (put->snarf < 0) {
-		close(fd[0]);
-		free(put);
+		fprintf(stderr, "open /dev/snarf: %s\n", termaux.err);
+		goto error;
+	}
+	fsbulk(&termctx, put->snarf, 1);
+	put->event = wl_event_loop_add_fd(evt, fd[0], WL_EVENT_READABLE, snarfput, put);
+	if (!put->event) {
+		fprintf(stderr, "failed to add wl_data_source event source\n");
+		goto error;
+	}
+	return;
+
+error:
+	close(fd[0]);
+	snarfdone(put);
+}
+
+static const struct wl_data_device_interface data_device_impl = {
+	.start_drag = start_drag,
+	.set_selection = set_selection,
+	.release = destroy,
+};
+
+/* wl_data_device_manager */
+static void
+get_data_device(struct wl_client *c, struct wl_resource *r, uint32_t id, struct wl_resource *seat)
+{
+	struct wl_resource *nr;
+	uint32_t ver;
+
+	ver = wl_resource_get_version(r);
+	nr = wl_resource_create(c, &wl_data_device_interface, ver, id);
+	if (!nr) {
+		wl_resource_post_no_memory(r);
 		return;
 	}
-	if (fsopen(&termctx, NULL, put->snarf, C9write) != 0) {
-		fsclunk(&termctx, put->snarf);
-		close(fd[0]);
-		free(put);
+	wl_resource_set_implementation(nr, &data_device_impl, NULL, unlink_resource);
+	wl_list_insert(&datadev.resources, wl_resource_get_link(nr));
+}
+
+static const struct wl_data_device_manager_interface dataman_impl = {
+	.create_data_source = create_data_source,
+	.get_data_device = get_data_device,
+};
+
+static void
+bind_dataman(struct wl_client *c, void *p, uint32_t ver, uint32_t id)
+{
+	struct wl_resource *r;
+
+	r = wl_resource_create(c, &wl_data_device_manager_interface, ver, id);
+	if (!r) {
+		wl_client_post_no_memory(c);
 		return;
 	}
-	put->event = wl_event_loop_add_fd(evt, fd[0], WL_EVENT_READABLE, snarfput, put);
+	wl_resource_set_implementation(r, &dataman_impl, NULL, NULL);
+}
+
+/* wl_output */
+static void
+bind_output(struct wl_client *c, void *p, uint32_t ver, uint32_t id)
+{
+	struct wl_resource *r;
+
+	r = wl_resource_create(c, &wl_output_interface, ver, id);
+	if (!r) {
+		wl_client_post_no_memory(c);
+		return;
+	}
+	wl_resource_set_implementation(r, NULL, NULL, unlink_resource);
+	wl_list_insert(&output.resources, wl_resource_get_link(r));
+	wl_output_send_geometry(r, 0, 0, 0, 0, WL_OUTPUT_SUBPIXEL_UNKNOWN, "plan9", "rio", WL_OUTPUT_TRANSFORM_NORMAL);
+	wl_output_send_mode(r, WL_OUTPUT_MODE_CURRENT, draw.x1 - draw.x0, draw.y1 - draw.y0, 0);
+	if (ver >= 2)
+		wl_output_send_scale(r, outscale);
+	wl_output_send_done(r);
+}
+
+/* wp_viewport */
+static void
+set_source(struct wl_client *c, struct wl_resource *r, wl_fixed_t x, wl_fixed_t y, wl_fixed_t w, wl_fixed_t h)
+{
+	struct surface *s;
+
+	s = wl_resource_get_user_data(r);
+	if (!s) {
+		wl_resource_post_error(r, WP_VIEWPORT_ERROR_NO_SURFACE, "surface was destroyed");
+		return;
+	}
+	if (x == wl_fixed_from_int(-1) && y == x && w == x && h == x) {
+		s->pending.srcw = -1;
+		return;
+	}
+	if (x < 0 || y < 0 || w <= 0 || h <= 0) {
+		wl_resource_post_error(r, WP_VIEWPORT_ERROR_BAD_VALUE, "invalid source rectangle");
+		return;
+	}
+	s->pending.srcx = x, s->pending.srcy = y;
+	s->pending.srcw = w, s->pending.srch = h;
+}
+
+static void
+set_destination(struct wl_client *c, struct wl_resource *r, int32_t w, int32_t h)
+{
+	struct surface *s;
+
+	s = wl_resource_get_user_data(r);
+	if (!s) {
+		wl_resource_post_error(r, WP_VIEWPORT_ERROR_NO_SURFACE, "surface was destroyed");
+		return;
+	}
+	if (w == -1 && h == -1) {
+		s->pending.dstw = -1;
+		return;
+	}
+	if (w <= 0 || h <= 0) {
+		wl_resource_post_error(r, WP_VIEWPORT_ERROR_BAD_VALUE, "invalid destination size");
+		return;
+	}
+	s->pending.dstw = w;
+	s->pending.dsth = h;
 }
 
-static const struct wl_data_device_interface data_device_impl = {
-	.start_drag = start_drag,
-	.set_selection = set_selection,
-	.release = destroy,
+static const struct wp_viewport_interface viewport_impl = {
+	.destroy = destroy,
+	.set_source = set_source,
+	.set_destination = set_destination,
 };
 
-/* wl_data_device_manager */
+/* the viewport is removed at the surface's next commit */
 static void
-get_data_device(struct wl_client *c, struct wl_resource *r, uint32_t id, struct wl_resource *seat)
+viewport_destroy(struct wl_resource *r)
 {
-	struct wl_resource *nr;
+	struct surface *s;
+
+	s = wl_resource_get_user_data(r);
+	if (!s)
+		return;
+	s->viewport = NULL;
+	s->pending.srcw = -1;
+	s->pending.dstw = -1;
+}
+
+/* wp_viewporter */
+static void
+get_viewport(struct wl_client *c, struct wl_resource *r, uint32_t id, struct wl_resource *sr)
+{
+	struct surface *s;
+	struct wl_resource *vr;
 	uint32_t ver;
 
+	s = wl_resource_get_user_data(sr);
+	if (s->viewport) {
+		wl_resource_post_error(r, WP_VIEWPORTER_ERROR_VIEWPORT_EXISTS, "surface already has a viewport");
+		return;
+	}
 	ver = wl_resource_get_version(r);
-	nr = wl_resource_create(c, &wl_data_device_interface, ver, id);
-	if (!nr) {
-		wl_resource_post_no_memory(r);
+	vr = wl_resource_create(c, &wp_viewport_interface, ver, id);
+	if (!vr) {
+		wl_client_post_no_memory(c);
 		return;
 	}
-	wl_resource_set_implementation(nr, &data_device_impl, NULL, unlink_resource);
-	wl_list_insert(&datadev.resources, wl_resource_get_link(nr));
+	wl_resource_set_implementation(vr, &viewport_impl, s, viewport_destroy);
+	s->viewport = vr;
 }
 
-static const struct wl_data_device_manager_interface dataman_impl = {
-	.create_data_source = create_data_source,
-	.get_data_device = get_data_device,
+static const struct wp_viewporter_interface viewporter_impl = {
+	.destroy = destroy,
+	.get_viewport = get_viewport,
 };
 
 static void
-bind_dataman(struct wl_client *c, void *p, uint32_t ver, uint32_t id)
+bind_viewporter(struct wl_client *c, void *p, uint32_t ver, uint32_t id)
 {
 	struct wl_resource *r;
 
-	r = wl_resource_create(c, &wl_data_device_manager_interface, ver, id);
+	r = wl_resource_create(c, &wp_viewporter_interface, ver, id);
 	if (!r) {
 		wl_client_post_no_memory(c);
 		return;
 	}
-	wl_resource_set_implementation(r, &dataman_impl, NULL, NULL);
+	wl_resource_set_implementation(r, &viewporter_impl, NULL, NULL);
 }
 
-/* wl_output */
+/* wp_presentation */
 static void
-bind_output(struct wl_client *c, void *p, uint32_t ver, uint32_t id)
+feedback(struct wl_client *c, struct wl_resource *r, struct wl_resource *sr, uint32_t id)
+{
+	struct surface *s;
+	struct wl_resource *fr;
+
+	s = wl_resource_get_user_data(sr);
+	fr = wl_resource_create(c, &wp_presentation_feedback_interface, 1, id);
+	if (!fr) {
+		wl_client_post_no_memory(c);
+		return;
+	}
+	wl_resource_set_implementation(fr, NULL, NULL, unlink_resource);
+	wl_list_insert(s->pending.feedback.prev, wl_resource_get_link(fr));
+}
+
+static const struct wp_presentation_interface presentation_impl = {
+	.destroy = destroy,
+	.feedback = feedback,
+};
+
+static void
+bind_presentation(struct wl_client *c, void *p, uint32_t ver, uint32_t id)
 {
 	struct wl_resource *r;
 
-	r = wl_resource_create(c, &wl_output_interface, ver, id);
+	r = wl_resource_create(c, &wp_presentation_interface, ver, id);
 	if (!r) {
 		wl_client_post_no_memory(c);
 		return;
 	}
-	wl_resource_set_implementation(r, NULL, NULL, unlink_resource);
-	wl_list_insert(&output.resources, wl_resource_get_link(r));
-	wl_output_send_geometry(r, 0, 0, 0, 0, WL_OUTPUT_SUBPIXEL_UNKNOWN, "plan9", "rio", WL_OUTPUT_TRANSFORM_NORMAL);
-	wl_output_send_mode(r, WL_OUTPUT_MODE_CURRENT, draw.x1 - draw.x0, draw.y1 - draw.y0, 0);
-	wl_output_send_done(r);
+	wl_resource_set_implementation(r, &presentation_impl, NULL, NULL);
+	wp_presentation_send_clock_id(r, CLOCK_MONOTONIC);
 }
 
 static void
@@ -1749,133 +4161,340 @@ drawinit(C9ctx *ctx)
 		return -1;
 	}
 
-	draw.buflen = 32768;
-	if (draw.datafd < 0) {
-		draw.ctlfid = fswalk(ctx, NULL, draw.datafid, (const char *[]){"dev", "draw", "new", 0});
-		if (draw.ctlfid < 0) {
-			fprintf(stderr, "fswalk /dev/draw/new: %s\n", aux->err);
-			return -1;
-		}
-		if (fsopen(ctx, NULL, draw.ctlfid, C9read) != 0) {
-			fprintf(stderr, "fsopen /dev/draw/new: %s\n", aux->err);
-			return -1;
-		}
-		if (fsread(ctx, NULL, &r, draw.ctlfid, 0, 144) != 0) {
-			fprintf(stderr, "fsread /dev/draw/new: %s\n", aux->err);
-			return -1;
-		}
-		if (r->read.size < 96) {
-			fprintf(stderr, "fsread /dev/draw/new: too short\n");
-			return -1;
-		}
-		r->read.data[11] = '\0';
-		strcpy(conn, (char *)r->read.data + strspn((char *)r->read.data, " "));
-		r->read.data[96] = '\0';
-		draw.x0 = atoi((char *)r->read.data + 48);
-		draw.y0 = atoi((char *)r->read.data + 60);
-		draw.x1 = atoi((char *)r->read.data + 72);
-		draw.y1 = atoi((char *)r->read.data + 84);
-		free(r);
-		draw.datafid = fswalk(ctx, NULL, term.root, (const char *[]){"dev", "draw", conn, "data", 0});
-		if (draw.datafid < 0) {
-			fprintf(stderr, "fswalk /dev/draw/%s/data: %s\n", conn, aux->err);
-			return -1;
-		}
-		if (fsopen(ctx, &tag, draw.datafid, C9write) != 0) {
-			fprintf(stderr, "fsopen /dev/draw/%s/data: %s\n", conn, aux->err);
-			return -1;
-		}
-		r = fswait(ctx, tag, Ropen);
-		if (!r) {
-			fprintf(stderr, "fsopen /dev/draw/%s/data: %s\n", conn, aux->err);
-			return -1;
-		}
-		if (r->iounit)
-			draw.buflen = r->iounit;
-		free(r);
+	draw.buflen = ctx->msize - IOHDRSZ;
+	draw.ctlfid = fsopenpath(ctx, draw.root, (const char *[]){"dev", "draw", "new", 0}, C9read);
+	if (draw.ctlfid < 0) {
+		fprintf(stderr, "open /dev/draw/new: %s\n", aux->err);
+		return -1;
+	}
+	if (fsread(ctx, NULL, &r, draw.ctlfid, 0, 144) != 0) {
+		fprintf(stderr, "fsread /dev/draw/new: %s\n", aux->err);
+		return -1;
+	}
+	if (r->read.size < 96) {
+		fprintf(stderr, "fsread /dev/draw/new: too short\n");
+		return -1;
+	}
+	r->read.data[11] = '\0';
+	strcpy(conn, (char *)r->read.data + strspn((char *)r->read.data, " "));
+	r->read.data[96] = '\0';
+	draw.x0 = atoi((char *)r->read.data + 48);
+	draw.y0 = atoi((char *)r->read.data + 60);
+	draw.x1 = atoi((char *)r->read.data + 72);
+	draw.y1 = atoi((char *)r->read.data + 84);
+	free(r);
+	draw.datafid = fswalk(ctx, NULL, draw.root, (const char *[]){"dev", "draw", conn, "data", 0});
+	if (draw.datafid < 0) {
+		fprintf(stderr, "fswalk /dev/draw/%s/data: %s\n", conn, aux->err);
+		return -1;
+	}
+	if (fsopen(ctx, &tag, draw.datafid, C9write) != 0) {
+		fprintf(stderr, "fsopen /dev/draw/%s/data: %s\n", conn, aux->err);
+		return -1;
+	}
+	r = fswait(ctx, tag, Ropen);
+	if (!r) {
+		fprintf(stderr, "fsopen /dev/draw/%s/data: %s\n", conn, aux->err);
+		return -1;
 	}
+	if (r->iounit && r->iounit < draw.buflen)
+		draw.buflen = r->iounit;
+	fsbulk(ctx, draw.datafid, 1);
+	free(r);
 	draw.buf = malloc(draw.buflen);
 	if (!draw.buf) {
 		perror(NULL);
 		return -1;
 	}
+	draw.opaque = numget(&draw.imgid);
+	if (draw.opaque < 0) {
+		perror(NULL);
+		return -1;
+	}
+	drawsend(drawb(draw.buf, draw.opaque, ARGB32, 1, (int[]){0, 0, 1, 1}, 0xffffffff));
 
 	return 0;
 }
 
+struct kbmapread {
+	struct kbmapget *get;
+	uint64_t off;
+};
+
+/* /dev/kbmap being read after its stat changed */
+struct kbmapget {
+	struct kbmapread rd[KBMAPREADS];
+	int reads;  /* in flight */
+	int err;
+	uint32_t readsz;
+	uint64_t next;  /* offset of the next read */
+	uint64_t len;   /* end of the file, once a short read is seen */
+	char *data;
+	size_t cap;
+};
+
+/* the part of the kbmap not yet passed to writekeymap */
+struct kbmaplines {
+	char *pos, *end;
+};
+
 static int
 kbmapline(void *aux, char **str, size_t *len)
 {
-	static uint64_t off;
-	C9r *r;
-	int fid;
+	struct kbmaplines *l;
+	char *nl;
 
-	fid = *(int *)aux;
-	if (fsread(&termctx, NULL, &r, fid, off, 36) != 0) {
-		fprintf(stderr, "read /dev/kbmap: %s\n", termaux.err);
-		return -1;
-	}
-	if (r->read.size == 0)
+	l = aux;
+	if (l->pos == l->end)
 		return 0;
-	if (r->read.size != 36 || r->read.data[r->read.size - 1] != '\n') {
-		fprintf(stderr, "read /dev/kbmap: unexpected line size\n");
+	nl = memchr(l->pos, '\n', l->end - l->pos);
+	if (!nl) {
+		fprintf(stderr, "read /dev/kbmap: unterminated line\n");
 		return -1;
 	}
-	off += r->read.size;
-	r->read.data[r->read.size - 1] = '\0';
-	*str = (char *)r->read.data;
-	*len = r->read.size - 1;
+	*nl = '\0';
+	*str = l->pos;
+	*len = nl - l->pos;
+	l->pos = nl + 1;
 	return 1;
 }
 
 static int
-keymapinit(C9ctx *ctx)
+keymapload(char *data, size_t len)
 {
-	C9aux *aux;
 	FILE *f;
-	int fid;
+	struct kbmaplines l;
 	struct stat st;
+	int fd;
 
-	aux = ctx->aux;
 	f = tmpfile();
 	if (!f) {
 		perror("tmpfile");
 		return -1;
 	}
-	fid = fswalk(ctx, NULL, term.root, (const char *[]){"dev", "kbmap", 0});
-	if (fid < 0) {
-		fprintf(stderr, "fswalk /dev/kbmap: %s\n", aux->err);
+	l.pos = data;
+	l.end = data + len;
+	if (writekeymap(f, kbmapline, &l) != 0)
+		goto error;
+	fd = dup(fileno(f));
+	if (fd < 0) {
+		perror("dup");
+		goto error;
+	}
+	fclose(f);
+	if (fstat(fd, &st) != 0) {
+		perror("fstat");
+		close(fd);
 		return -1;
 	}
-	if (fsopen(ctx, NULL, fid, C9read) != 0) {
-		fprintf(stderr, "fsopen /dev/kbmap: %s\n", aux->err);
+	if (kbd.keymapfd >= 0)
+		close(kbd.keymapfd);
+	kbd.keymapfd = fd;
+	kbd.keymapsize = st.st_size;
+	return 0;
+
+error:
+	fclose(f);
+	return -1;
+}
+
+static void kbmapgot(C9r *reply, void *aux);
+
+static int
+kbmapread(struct kbmapread *rd)
+{
+	struct kbmapget *get;
+	C9tag tag;
+
+	get = rd->get;
+	rd->off = get->next;
+	if (fsread(&termctx, &tag, NULL, kbd.kbmap, rd->off, get->readsz) != 0) {
+		fprintf(stderr, "read /dev/kbmap: %s\n", termaux.err);
 		return -1;
 	}
-	if (writekeymap(f, kbmapline, &fid) != 0)
+	fsasync(&termctx, tag, kbmapgot, rd);
+	get->next += get->readsz;
+	++get->reads;
+	return 0;
+}
+
+static void
+kbmapdone(struct kbmapget *get)
+{
+	struct wl_resource *r;
+
+	if (!get->err && keymapload(get->data, get->len) == 0) {
+		wl_resource_for_each(r, &kbd.active)
+			wl_keyboard_send_keymap(r, WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1, kbd.keymapfd, kbd.keymapsize);
+		wl_resource_for_each(r, &kbd.inactive)
+			wl_keyboard_send_keymap(r, WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1, kbd.keymapfd, kbd.keymapsize);
+	}
+	free(get->data);
+	free(get);
+	wl_event_source_timer_update(kbd.kbmaptimer, KBMAPPOLL);
+}
+
+/*
+ * Read /dev/kbmap with up to KBMAPREADS reads in flight. kbdfs
+ * returns one line per read however large the count, so the first
+ * read asks for msize and, if it comes back short, its size is used
+ * for the rest. Replies land at their own offsets, and the first
+ * short read after that marks the end.
+ */
+static void
+kbmapgot(C9r *reply, void *aux)
+{
+	struct kbmapread *rd;
+	struct kbmapget *get;
+	size_t end, cap;
+	char *data;
+	int i;
+
+	rd = aux;
+	get = rd->get;
+	--get->reads;
+	if (reply->type == Rerror) {
+		fprintf(stderr, "read /dev/kbmap: %s\n", reply->error);
+		get->err = 1;
+	} else if (!get->err) {
+		end = rd->off + reply->read.size;
+		if (end > get->cap) {
+			cap = get->cap ? get->cap : end;
+			while (cap < end)
+				cap *= 2;
+			data = realloc(get->data, cap);
+			if (!data) {
+				perror(NULL);
+				get->err = 1;
+				goto done;
+			}
+			get->data = data;
+			get->cap = cap;
+		}
+		memcpy(get->data + rd->off, reply->read.data, reply->read.size);
+		if (rd->off == 0 && reply->read.size > 0) {
+			get->readsz = reply->read.size;
+			get->next = reply->read.size;
+			for (i = 0; i < KBMAPREADS; ++i) {
+				get->rd[i].get = get;
+				if (kbmapread(&get->rd[i]) != 0) {
+					get->err = 1;
+					break;
+				}
+			}
+		} else if (reply->read.size < get->readsz) {
+			if (end < get->len)
+				get->len = end;
+		} else if (get->next < get->len && kbmapread(rd) != 0) {
+			get->err = 1;
+		}
+	}
+done:
+	if (get->reads == 0)
+		kbmapdone(get);
+}
+
+/* start reading /dev/kbmap; the keymap is sent when it is complete */
+static int
+kbmapfetch(void)
+{
+	struct kbmapget *get;
+
+	get = calloc(1, sizeof *get);
+	if (!get) {
+		perror(NULL);
 		return -1;
-	if (fsclunk(ctx, fid) != 0)
+	}
+	get->readsz = termctx.msize - IOHDRSZ;
+	get->len = -1;
+	get->rd[0].get = get;
+	if (kbmapread(&get->rd[0]) != 0) {
+		free(get);
 		return -1;
-	kbd.keymapfd = dup(fileno(f));
-	if (kbd.keymapfd < 0) {
-		perror("dup");
+	}
+	return 0;
+}
+
+/* returns 1 if the stat differs from the last one seen */
+static int
+kbmapchanged(C9stat *st)
+{
+	int changed;
+
+	changed = st->qid.version != kbd.kbmapvers || st->mtime != kbd.kbmapmtime || st->size != kbd.kbmaplen;
+	kbd.kbmapvers = st->qid.version;
+	kbd.kbmapmtime = st->mtime;
+	kbd.kbmaplen = st->size;
+	return changed;
+}
+
+/* the poll timer is rearmed once any read of the kbmap is complete */
+static void
+kbmapstat(C9r *reply, void *data)
+{
+	if (reply->type == Rerror)
+		fprintf(stderr, "stat /dev/kbmap: %s\n", reply->error);
+	else if (kbmapchanged(&reply->stat) && kbmapfetch() == 0)
+		return;
+	wl_event_source_timer_update(kbd.kbmaptimer, KBMAPPOLL);
+}
+
+static int
+kbmappoll(void *data)
+{
+	C9tag tag;
+
+	if (fsstat(&termctx, &tag, NULL, kbd.kbmap) != 0) {
+		fprintf(stderr, "stat /dev/kbmap: %s\n", termaux.err);
+		wl_event_source_timer_update(kbd.kbmaptimer, KBMAPPOLL);
+		return 0;
+	}
+	fsasync(&termctx, tag, kbmapstat, NULL);
+	return 0;
+}
+
+static int
+keymapinit(C9ctx *ctx)
+{
+	C9aux *aux;
+	C9r *r;
+
+	aux = ctx->aux;
+	kbd.keymapfd = -1;
+	kbd.kbmap = fsopenpath(ctx, term.root, (const char *[]){"dev", "kbmap", 0}, C9read);
+	if (kbd.kbmap < 0) {
+		fprintf(stderr, "open /dev/kbmap: %s\n", aux->err);
 		return -1;
 	}
-	fclose(f);
-	if (fstat(kbd.keymapfd, &st) != 0) {
-		perror("fstat");
+	if (fsstat(ctx, NULL, &r, kbd.kbmap) != 0) {
+		fprintf(stderr, "fsstat /dev/kbmap: %s\n", aux->err);
 		return -1;
 	}
-	kbd.keymapsize = st.st_size;
-	return 0;
+	kbmapchanged(&r->stat);
+	free(r);
+	return kbmapfetch();
 }
 
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: wl9 [-t termrfd[,termwfd]] [-w wsysrfd[,wsyswfd]] [-d datawfd]\n");
+	fprintf(stderr, "usage: wl9 [-t termrfd[,termwfd]] [-d drawrfd[,drawwfd]] [-m msize] [-w maxwrite]\n"
+		"           [-c motionms] [-r readdepth] [-s scale] [-R session]\n");
 	exit(1);
 }
 
+static int
+numarg(char *s, int max)
+{
+	long n;
+
+	errno = 0;
+	n = strtol(s, &s, 10);
+	if (errno != 0 || n < 0 || n > max || *s != '\0')
+		usage();
+	return n;
+}
+
 static void
 fdpair(char *s, int *rfd, int *wfd)
 {
@@ -1905,28 +4524,26 @@ termenv(const char *var)
 	int fid;
 	char *val;
 
-	fid = fswalk(&termctx, NULL, term.root, (const char*[]){"env", var, 0});
+	fid = fsopenpath(&termctx, term.root, (const char *[]){"env", var, 0}, C9read);
 	if (fid < 0) {
-		fprintf(stderr, "fswalk /env/%s: %s\n", var, termaux.err);
-		return NULL;
-	}
-	if (fsopen(&termctx, NULL, fid, C9read) != 0) {
-		fprintf(stderr, "fsopen /env/%s: %s\n", var, termaux.err);
-		fsclunk(&termctx, fid);
+		fprintf(stderr, "open /env/%s: %s\n", var, termaux.err);
 		return NULL;
 	}
 	if (fsread(&termctx, NULL, &r, fid, 0, 128) != 0) {
 		fprintf(stderr, "fsread /env/%s: %s\n", var, termaux.err);
-		fsclunk(&termctx, fid);
+		fsclunk(&termctx, NULL, fid);
 		return NULL;
 	}
+	fsclunk(&termctx, NULL, fid);
 	val = malloc(r->read.size + 1);
 	if (!val) {
 		perror(NULL);
+		free(r);
 		return NULL;
 	}
 	memcpy(val, r->read.data, r->read.size);
 	val[r->read.size] = '\0';
+	free(r);
 	return val;
 }
 
@@ -1990,6 +4607,64 @@ launch(char *argv[])
 	close(fd[1]);
 }
 
+static void
+histprint(const char *name, const struct hist *h)
+{
+	fprintf(stderr, "\t%s: n=%"PRIu64" p50=%"PRIu64"us p95=%"PRIu64"us p99=%"PRIu64"us\n",
+		name, h->n, histpct(h, 50), histpct(h, 95), histpct(h, 99));
+}
+
+static int
+dumpstats(int sig, void *data)
+{
+	struct window *w;
+
+	fprintf(stderr, "9p\n");
+	fsstats(&termctx, stderr);
+	if (draw.ctx == &drawctx) {
+		fprintf(stderr, "9p draw\n");
+		fsstats(&drawctx, stderr);
+	}
+	wl_list_for_each(w, &windows, link) {
+		fprintf(stderr, "window %s\n", w->name);
+		histprint("input-to-commit", &w->commitlat);
+		histprint("input-to-photon", &w->photonlat);
+	}
+	return 0;
+}
+
+#ifdef TRACE
+static int
+dumptrace(int sig, void *data)
+{
+	char path[64];
+
+	snprintf(path, sizeof path, "/tmp/wl9.%ld.trace.json", (long)getpid());
+	if (tracewrite(path) == 0)
+		fprintf(stderr, "wrote trace to %s\n", path);
+	return 0;
+}
+#endif
+
+/*
+ * Write the messages queued since the last pass of the event loop,
+ * and watch for writability if some did not fit.
+ */
+static void
+fsflushT(C9ctx *ctx, struct wl_event_source *event, uint32_t *eventmask)
+{
+	uint32_t mask;
+
+	fswriteT(ctx);
+	mask = WL_EVENT_READABLE;
+	if (fspending(ctx))
+		mask |= WL_EVENT_WRITABLE;
+	if (mask != *eventmask) {
+		wl_event_source_fd_update(event, mask);
+		*eventmask = mask;
+	}
+}
+
 static int
 fsready(int fd, uint32_t mask, void *ptr)
 {
@@ -2012,25 +4687,55 @@ main(int argc, char *argv[])
 		wl_global_bind_func_t bind;
 	} *g, globals[] = {
 		{&wl_compositor_interface, 5, bind_compositor},
+		{&wl_subcompositor_interface, 1, bind_subcompositor},
 		{&wl_seat_interface, 5, bind_seat},
 		{&wl_data_device_manager_interface, 3, bind_dataman},
 		{&xdg_wm_base_interface, 3, bind_wm},
 		{&wl_output_interface, 4, bind_output},
 		{&org_kde_kwin_server_decoration_manager_interface, 1, bind_decoman},
+		{&wp_viewporter_interface, 1, bind_viewporter},
+		{&wp_presentation_interface, 1, bind_presentation},
 	};
 	struct wl_list *clients;
 	char *wsys, *err;
 	const char *wsyspath[C9maxpathel], *sock;
-	uint32_t mask;
 
 	termaux.rfd = -1;
-	draw.datafd = -1;
+	drawaux.rfd = -1;
+	drawaux.conn = 1;
 	ARGBEGIN {
 	case 't':
 		fdpair(EARGF(usage()), &termaux.rfd, &termaux.wfd);
 		break;
 	case 'd':
-		fdpair(EARGF(usage()), &draw.datafd, NULL);
+		fdpair(EARGF(usage()), &drawaux.rfd, &drawaux.wfd);
+		break;
+	case 'm':
+		termaux.msize = numarg(EARGF(usage()), MAXMSIZE);
+		if (termaux.msize < C9minmsize)
+			usage();
+		drawaux.msize = termaux.msize;
+		break;
+	case 'w':
+		termaux.maxwrite = numarg(EARGF(usage()), MAXMSIZE);
+		drawaux.maxwrite = termaux.maxwrite;
+		break;
+	case 'c':
+		mouse.delay = numarg(EARGF(usage()), 1000);
+		break;
+	case 'r':
+		readdepth = numarg(EARGF(usage()), MAXREADS);
+		if (readdepth == 0)
+			usage();
+		break;
+	case 's':
+		outscale = numarg(EARGF(usage()), BOXMAX);
+		if (outscale == 0)
+			usage();
+		break;
+	case 'R':
+		if (recopen(EARGF(usage())) != 0)
+			return 1;
 		break;
 	default:
 		usage();
@@ -2043,9 +4748,12 @@ main(int argc, char *argv[])
 			return 1;
 		}
 		termaux.wfd = termaux.rfd;
+		if (termaux.maxwrite == 0)
+			termaux.maxwrite = BUFSIZE;
 	}
 
-	fsinit(&termctx, &termaux);
+	if (fsinit(&termctx, &termaux) != 0)
+		return 1;
 	fprintf(stderr, "9p msize %"PRIu32"\n", termctx.msize);
 	term.root = fsattach(&termctx, NULL);
 	if (term.root < 0)
@@ -2072,7 +4780,18 @@ main(int argc, char *argv[])
 	if (fsopen(&termctx, NULL, term.snarf, C9read) != 0)
 		return 1;
 
-	if (drawinit(&termctx) != 0)
+	if (drawaux.rfd >= 0) {
+		if (fsinit(&drawctx, &drawaux) != 0)
+			return 1;
+		draw.ctx = &drawctx;
+		draw.root = fsattach(&drawctx, NULL);
+		if (draw.root < 0)
+			return 1;
+	} else {
+		draw.ctx = &termctx;
+		draw.root = term.root;
+	}
+	if (drawinit(draw.ctx) != 0)
 		return 1;
 	if (keymapinit(&termctx) != 0)
 		return 1;
@@ -2080,6 +4799,7 @@ main(int argc, char *argv[])
 	wl_list_init(&mouse.inactive);
 	wl_list_init(&kbd.active);
 	wl_list_init(&kbd.inactive);
+	wl_list_init(&windows);
 
 	dpy = wl_display_create();
 	if (!dpy) {
@@ -2092,6 +4812,40 @@ main(int argc, char *argv[])
 		fprintf(stderr, "failed to add 9p event source\n");
 		return 1;
 	}
+	term.eventmask = WL_EVENT_READABLE;
+	if (draw.ctx == &drawctx) {
+		draw.event = wl_event_loop_add_fd(evt, drawaux.rfd, WL_EVENT_READABLE, fsready, &drawctx);
+		if (!draw.event) {
+			fprintf(stderr, "failed to add 9p draw event source\n");
+			return 1;
+		}
+		draw.eventmask = WL_EVENT_READABLE;
+	}
+	kbd.kbmaptimer = wl_event_loop_add_timer(evt, kbmappoll, NULL);
+	if (!kbd.kbmaptimer) {
+		fprintf(stderr, "failed to add kbmap timer\n");
+		return 1;
+	}
+	mouse.timer = wl_event_loop_add_timer(evt, mousetimer, NULL);
+	if (!mouse.timer) {
+		fprintf(stderr, "failed to add mouse timer\n");
+		return 1;
+	}
+	cursor.timer = wl_event_loop_add_timer(evt, cursortimer, NULL);
+	if (!cursor.timer) {
+		fprintf(stderr, "failed to add cursor timer\n");
+		return 1;
+	}
+	if (!wl_event_loop_add_signal(evt, SIGUSR1, dumpstats, NULL)) {
+		fprintf(stderr, "failed to add SIGUSR1 handler\n");
+		return 1;
+	}
+#ifdef TRACE
+	if (!wl_event_loop_add_signal(evt, SIGUSR2, dumptrace, NULL)) {
+		fprintf(stderr, "failed to add SIGUSR2 handler\n");
+		return 1;
+	}
+#endif
 	sock = wl_display_add_socket_auto(dpy);
 	if (!sock) {
 		fprintf(stderr, "failed to add socket\n");
@@ -2116,12 +4870,13 @@ main(int argc, char *argv[])
 	clients = wl_display_get_client_list(dpy);
 	while (!argc || !wl_list_empty(clients)) {
 		wl_display_flush_clients(dpy);
+		fsflushT(&termctx, term.event, &term.eventmask);
+		if (draw.event)
+			fsflushT(&drawctx, draw.event, &draw.eventmask);
 		wl_event_loop_dispatch(evt, -1);
 		fsdispatch(&termctx);
-		mask = WL_EVENT_READABLE;
-		if (termaux.wend > termaux.wpos)
-			mask |= WL_EVENT_WRITABLE;
-		if (mask != term.eventmask)
-			wl_event_source_fd_update(term.event, mask);
+		if (draw.event)
+			fsdispatch(&drawctx);
+		mouseflush();
 	}
 }